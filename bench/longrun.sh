@@ -0,0 +1,120 @@
+#!/bin/sh
+#
+# long-running leak check for nsh
+#
+# drives one shell session through many rounds of a mixed workload
+# (pipelines, redirections, background jobs, failing commands,
+# builtin stages) and samples its rss, malloc heap (from memstats)
+# and open fd count every few rounds. the first sample after the
+# warm-up is the baseline; exits 1 if the last one has grown past
+# the limits, 0 otherwise.
+#
+# usage: bench/longrun.sh [path to nsh]
+#
+# environment:
+#   ROUNDS      rounds of the workload (default 2000)
+#   EVERY       sample every this many rounds (default 100)
+#   WARMUP      rounds before the baseline is taken (default 100)
+#   MAX_RSS_KB  allowed rss growth in kB (default 2048)
+#   MAX_HEAP    allowed growth of malloc'd bytes in use (default 262144)
+#   MAX_FDS     allowed growth of open fds (default 0)
+#
+
+NSH=${1:-./nsh}
+ROUNDS=${ROUNDS:-2000}
+EVERY=${EVERY:-100}
+WARMUP=${WARMUP:-100}
+MAX_RSS_KB=${MAX_RSS_KB:-2048}
+MAX_HEAP=${MAX_HEAP:-262144}
+MAX_FDS=${MAX_FDS:-0}
+
+if [ ! -x "$NSH" ]; then
+    echo "longrun: $NSH is not executable, build it first:" >&2
+    echo "    gcc -O2 -pthread -o nsh main.c" >&2
+    exit 2
+fi
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/nsh-longrun.XXXXXX") || exit 2
+trap 'exec 3>&-; kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+mkfifo "$dir/in"
+seq 1 2000 > "$dir/data"
+
+"$NSH" < "$dir/in" > "$dir/out" 2> "$dir/err" &
+pid=$!
+exec 3> "$dir/in"
+
+# command names stay the same from round to round: stats and the
+# path cache keep one entry per distinct name, by design
+round() {
+    cat >&3 <<CMDS
+echo round $1 | tr a-z A-Z > $dir/scratch
+cat $dir/data | grep 7 | wc -l > $dir/scratch
+sort -n $dir/data | head -3 > $dir/scratch
+fields 1 < $dir/data > $dir/scratch
+ls $dir/nonexistent 2> $dir/scratch
+no-such-command 2> $dir/scratch
+true &
+sleep 0 &
+stats > $dir/scratch
+CMDS
+}
+
+# memstats goes to the shell's stdout; a marker after it says
+# the sample is complete
+sample() {
+    echo "memstats" >&3
+    echo "echo mark $1" >&3
+    n=0
+    until grep -q "^mark $1\$" "$dir/out"; do
+        n=$((n + 1))
+        if [ $n -gt 3000 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "longrun: the shell stopped answering" >&2
+            cat "$dir/err" >&2
+            exit 2
+        fi
+        sleep 0.01
+    done
+    heap=$(grep "^malloc " "$dir/out" | tail -1 | awk '{ print $2 }')
+    rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+    fds=$(ls /proc/$pid/fd | wc -l)
+    echo "$1 $rss $heap $fds"
+}
+
+printf "%8s %10s %12s %6s\n" round rss_kb heap fds
+i=1
+base=""
+while [ $i -le "$ROUNDS" ]; do
+    round $i
+    if [ $((i % EVERY)) -eq 0 ]; then
+        s=$(sample $i) || exit 2
+        set -- $s
+        printf "%8s %10s %12s %6s\n" "$1" "$2" "$3" "$4"
+        if [ -z "$base" ] && [ $i -ge "$WARMUP" ]; then
+            base="$2 $3 $4"
+        fi
+        last="$2 $3 $4"
+    fi
+    i=$((i + 1))
+done
+
+if [ -z "$base" ]; then
+    echo "longrun: no samples, ROUNDS is below WARMUP or EVERY" >&2
+    exit 2
+fi
+
+set -- $base $last
+status=0
+if [ $(($4 - $1)) -gt "$MAX_RSS_KB" ]; then
+    echo "longrun: rss grew by $(($4 - $1)) kB (limit $MAX_RSS_KB)"
+    status=1
+fi
+if [ $(($5 - $2)) -gt "$MAX_HEAP" ]; then
+    echo "longrun: heap grew by $(($5 - $2)) bytes (limit $MAX_HEAP)"
+    status=1
+fi
+if [ $(($6 - $3)) -gt "$MAX_FDS" ]; then
+    echo "longrun: open fds grew by $(($6 - $3)) (limit $MAX_FDS)"
+    status=1
+fi
+[ $status -eq 0 ] && echo "longrun: ok"
+exit $status
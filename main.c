@@ -10,6 +10,53 @@
  * - pipes + i/o redir combined
  * - running programs in the background
  * - backing up to a file if provided as a cl arg
+ * - batch mode: no prompt when stdin is not a terminal, exit on eof
+ * - usdt tracepoints (provider "nsh") for bpftrace/perf:
+ *     line_read(line, len)            a line was read
+ *     parse_start(line)               cmd_builder() starts
+ *     parse_done(num_cmds, ns)        cmd_builder() is done
+ *     spawn(pid, argv0, fork_ns)      a child was forked
+ *     reap(pid, status, wall_ns)      a child was reaped
+ * - stats builtin: p50/p90/p99/max of spawn, wall and cpu time per command
+ * - an epoll event loop: input, reaping (signalfd) and timers all go through it
+ * - prometheus metrics, written every -i seconds to the -m file (textfile
+ *   collector) and/or served over http on the -M unix socket
+ * - a json-lines execution log (-j file), one record per pipeline
+ * - a pool for background jobs: a fixed limit, or one that follows
+ *   cpu/memory/io pressure (psi) to keep stalls under a target
+ * - jobs builtin
+ * - prio prefix: nice value, scheduling policy and io priority for a
+ *   pipeline, plus defaults for everything started with &
+ * - children are spawned with clone3(): a pidfd comes back with the pid
+ *   and is what they are reaped through, prio -g starts them right
+ *   inside a cgroup. fork() + pidfd_open() on older kernels
+ * - children inherit nothing but 0, 1 and 2 (close-on-exec everywhere,
+ *   close_range() as a safety net)
+ * - export/unset builtins. children are exec'd with execve() on a cached
+ *   envp snapshot and a path looked up in a cache (see hash)
+ * - watch-run: re-runs a pipeline when files change (inotify)
+ * - every/at: run a pipeline periodically or at a given time, off the
+ *   event loop's timers
+ * - retry: re-runs a failing pipeline with exponential backoff
+ * - no limits on pipeline length or argument count: a parsed line lives
+ *   in one arena, on huge pages when it is big
+ * - memstats builtin: what the shell itself holds on to, and trimming it
+ * - builtin pipeline stages, forked but running our code instead of
+ *   exec'ing: sort (parallel, spills to disk past a memory budget),
+ *   count (sort | uniq -c | sort -rn in one hash table), fields (awk
+ *   '{print $N}' with a vectorized delimiter search), tr (table driven,
+ *   with vector shuffles when built with -mssse3 or -march=native),
+ *   grep (fixed strings), head. builtin stages next to each other run
+ *   fused in one child and hand their data on in memory, and stop
+ *   reading as soon as a head after them has its lines. between two
+ *   external stages the streaming ones run inside the shell instead,
+ *   as coroutines of the event loop. line-by-line stages reading a
+ *   regular file split it among one worker thread per cpu. needs
+ *   -pthread on older glibc
+ * - lines builtin: line ranges, tails and even parts of big files
+ *   straight from a cached index of line offsets
+ * - seq builtin stage: integers formatted into big blocks, without a
+ *   pipe when fused with the stage after it
  *
  * references:
  * - inspiration for the structure of my program: https://brennan.io/2015/01/16/write-a-shell-in-c/
@@ -17,14 +64,107 @@
  *
  * */
 
+#define _GNU_SOURCE
+
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <locale.h>
 #include <fcntl.h>
+#include <time.h>
+
+/* the probes are sys/sdt.h ones: a single nop in the binary
+ * until something attaches to them, so they stay in by default.
+ * build with -DNSH_NO_USDT to leave them out completely */
+#if !defined(NSH_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NSH_USDT
+#endif
+#endif
+
+#ifdef NSH_USDT
+#define PROBE1(name, a) DTRACE_PROBE1(nsh, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(nsh, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(nsh, name, a, b, c)
+#else
+/* sizeof keeps the arguments "used" without evaluating them */
+#define PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+/* latency histograms, in microseconds. buckets are log-linear
+ * like in HdrHistogram: 2^HIST_SUB_BITS buckets per power of two,
+ * so every value is off by at most 1/8, up to 2^HIST_MAX_BITS us */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB)
+
+/* which fields of a Prio are set */
+#define SET_NICE 1
+#define SET_POLICY 2
+#define SET_IOPRIO 4
+#define SET_CGROUP 8
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* what every does when a run is due and the last one isn't done */
+#define OVERLAP_SKIP 0
+#define OVERLAP_QUEUE 1
+#define OVERLAP_KILL 2
+
+/* arenas this big get a mapping of their own, on huge pages */
+#define ARENA_HUGE (2 << 20)
+
+/* what a worker of stage_split() takes on per round */
+#define SPLIT_CHUNK (8 << 20)
+
+/* seconds a metrics client gets to send its request */
+#define METRICS_IDLE 5
+
+/* records the json log holds on to while its writer is stuck,
+ * past this they are dropped */
+#define JLOG_MAX (16 << 20)
+
+/* the lines builtin keeps where every LIDX_STEP-th line starts,
+ * cached next to files from LIDX_CACHE_MIN bytes on */
+#define LIDX_STEP 1024
+#define LIDX_CACHE_MIN (1 << 20)
+
+/* what seq formats before handing it on */
+#define SEQ_BLOCK (1 << 20)
 
-#define TKS_BUFFER_SIZE 128
 #define READ 0
 #define WRITE 1
 
@@ -34,6 +174,17 @@ typedef struct
     char** args;
 } Command;
 
+/* scheduling settings a pipeline's children start with */
+typedef struct
+{
+    int set;
+    int nice;
+    int policy;
+    int ioclass;
+    int iolevel;
+    char* cgroup;
+} Prio;
+
 typedef struct
 {
     int num_cmds;
@@ -41,99 +192,1118 @@ typedef struct
     char* file_out;
     char* file_in;
     int overwrite;
+    Prio prio;
+    size_t arena_len;    // the whole thing is one arena, see cmd_builder()
 } FullCommand;
 
+typedef struct
+{
+    unsigned int counts[HIST_BUCKETS];
+    unsigned long long n;
+    unsigned long long sum;
+    unsigned long long max;
+} Hist;
+
+/* everything we know about one command name */
+typedef struct
+{
+    char* name;
+    Hist spawn;
+    Hist wall;
+    Hist cpu;
+} CmdStats;
+
+/* slot of the open-addressing table of CmdStats,
+ * the hash is kept to skip most string compares */
+typedef struct
+{
+    unsigned int hash;
+    CmdStats* st;
+} StatSlot;
+
+/* how one stage of a job went */
+typedef struct
+{
+    int pid;
+    int status;
+    long long t_spawn;
+    long long t_end;
+    struct rusage ru;
+} StageRun;
+
+/* a pipeline we started, alive until all of its children are reaped */
+typedef struct Job
+{
+    int id;
+    FullCommand* cmd;
+    int bg;
+    int queued;          // waiting for the pool to let it start
+    int running;         // children not reaped yet
+    int status;          // of the last stage
+    long long t_start;
+    struct timespec t_real;
+    char* cwd;           // only kept for the json log
+    StageRun* runs;      // one per stage
+    void (*on_done)(struct Job* job, void* ctx);
+    void* done_ctx;
+    struct Job* next;
+} Job;
+
+/* a child we forked and have not reaped yet */
+typedef struct
+{
+    int pid;
+    int pidfd;           // -1 if we have none, then SIGCHLD reaps it
+    long long t_spawn;
+    CmdStats* st;
+    Job* job;
+    int stage;
+    int stages;          // how many of them this child runs, see stage_run()
+} Proc;
+
+/* struct clone_args of the clone3() syscall, as of linux 5.7 */
+typedef struct
+{
+    unsigned long long flags;
+    unsigned long long pidfd;
+    unsigned long long child_tid;
+    unsigned long long parent_tid;
+    unsigned long long exit_signal;
+    unsigned long long stack;
+    unsigned long long stack_size;
+    unsigned long long tls;
+    unsigned long long set_tid;
+    unsigned long long set_tid_size;
+    unsigned long long cgroup;
+} CloneArgs;
+
+typedef void (*EvFunc)(int fd, unsigned int events, void* ctx);
+typedef void (*TimerFunc)(void* ctx);
+
+/* what to call when an fd registered with the event loop is ready */
+typedef struct
+{
+    EvFunc func;
+    void* ctx;
+} EvWatch;
+
+/* one-shot timer, kept in a min-heap on the deadline */
+typedef struct
+{
+    long long when;
+    int id;
+    TimerFunc func;
+    void* ctx;
+} Timer;
+
+/* slot of the open-addressing table of resolved command paths */
+typedef struct
+{
+    unsigned int hash;
+    char* name;
+    char* path;
+} PathSlot;
+
+typedef struct
+{
+    char* name;
+    int (*func)(Command* cmd);
+} Builtin;
+
+/* builtins that take a pipeline as their argument get
+ * the line before cmd_builder() has taken it apart */
+typedef struct
+{
+    char* name;
+    int (*func)(char* line);
+} LineBuiltin;
+
+struct Filter;
+
+/* where a stage's output goes: buffered up and written to fd,
+ * or handed on to the next stage when it is fused with it */
+typedef struct
+{
+    int fd;
+    struct Filter* next;
+    int done;            // next wants no more, what comes now is dropped
+    int task;            // in the shell: a full pipe waits, errors don't _exit()
+    char* buf;
+    size_t len;
+    size_t cap;
+} Out;
+
+/*
+ * a builtin stage at work. push() gets the input as it comes,
+ * in blocks of whole lines (of anything, with raw) that it may
+ * change in place, and returns 1 once it has had enough, like
+ * head does. finish() is called once there is no more and
+ * returns the exit status. what comes out goes to out
+ * */
+typedef struct Filter
+{
+    int (*push)(struct Filter* f, char* p, size_t n);
+    int (*finish)(struct Filter* f);
+    char** files;        // input files of its own, NULL: its stdin
+    size_t block;        // as the first stage, read blocks this big. 0: as they come
+    int raw;             // takes bytes, lines or not
+    int split;           // each line on its own: the input can be cut up among workers
+    void (*close)(struct Filter* f);   // frees what it holds, NULL if nothing
+    int source;          // makes its output out of nothing read: all its work is in finish()
+    Out out;
+} Filter;
+
+/* builtins that can be a stage of a pipeline. they are forked
+ * like any other command, but the child runs them as filters
+ * instead of exec'ing, and builtin stages next to each other
+ * run in the same child (see stage_run()). open() sets up a
+ * filter from the arguments and returns 0, or the exit status
+ * if they are wrong. -1 means it doesn't know them, then the
+ * real program of that name runs. with f NULL it only says
+ * whether it would take them, 1 when it reads files of its
+ * own and so can't be fed by the stage in front of it */
+typedef struct
+{
+    char* name;
+    int (*open)(Command* cmd, struct Filter** f);
+    int task;            // streams in bounded memory on one thread, see Task
+} Stage;
+
+/* how sort compares lines */
+typedef struct
+{
+    int rev;
+    int num;
+    int uniq;
+    int delim;           // -1: fields are split at blanks
+    int kbeg;            // first field of the key, from 1. 0: the whole line
+    int kend;            // last one, 0: to the end of the line
+} SortKey;
+
+/* a line for sort. key is the part it is sorted by, num
+ * that part as a number for -n. pre is the key's first 8
+ * bytes as a big-endian number: most compares are decided
+ * by it without going to memory the line is in */
+typedef struct
+{
+    const char* p;       // without the \n
+    size_t len;
+    const char* key;
+    size_t klen;
+    double num;
+    unsigned long long pre;
+} Line;
+
+/* a number for sort -n, as digits: the integer part without
+ * leading zeros and the fraction */
+typedef struct
+{
+    int neg;
+    const char* i;
+    size_t ilen;
+    const char* f;
+    size_t flen;
+} NumParts;
+
+/* the lines between beg and end, sorted by one thread */
+typedef struct
+{
+    SortKey* k;
+    const char* beg;
+    const char* end;
+    Line* lines;
+    size_t n;
+} SortPart;
+
+/* where the merge takes its lines from: a sorted part in
+ * memory, or a run that was spilled to a file */
+typedef struct
+{
+    Line cur;
+    int idx;             // ties go to the lower one, earlier input first
+    Line* lines;
+    size_t i;
+    size_t n;
+    int fd;              // -1 for a part in memory
+    char* buf;
+    size_t off;
+    size_t len;
+    size_t cap;
+} Source;
+
+typedef struct
+{
+    Filter f;
+    SortKey k;
+    int threads;
+    size_t limit;        // of the chunk in memory, half the -S budget
+    char* buf;
+    size_t len;
+    size_t cap;
+    Source* runs;
+    int num_runs;
+} SortF;
+
+/* the input of the first stage, files one after the other
+ * ("-" is stdin) and handed out in blocks of whole lines */
+typedef struct
+{
+    char** files;
+    int fd;              // -1 between files
+    int raw;             // any bytes will do, not just whole lines
+    char* buf;
+    size_t len;
+    size_t used;         // what the last block took of buf
+    size_t cap;
+} Blocks;
+
+/* a key count has seen, and how often */
+typedef struct
+{
+    unsigned long long hash;
+    const char* key;
+    size_t len;
+    unsigned long long n;
+} CountSlot;
+
+/* one thread's table. keys are copied into an arena of blocks
+ * that live as long as the stage, so merging tables is just
+ * moving pointers */
+typedef struct
+{
+    CountSlot* tab;
+    size_t cap;
+    size_t len;
+    char* arena;
+    size_t arena_off;
+    size_t arena_cap;
+    int field;           // 0: the whole line
+    int delim;           // -1: fields are split at blanks, awk style
+    const char* beg;     // this round's lines
+    const char* end;
+} CountTab;
+
+typedef struct
+{
+    Filter f;
+    int threads;
+    CountTab* tabs;
+    int coll;            // ties in the locale's order, not as bytes
+} CountF;
+
+/* fields N to M of a line, hi is INT_MAX for N- */
+typedef struct
+{
+    int lo;
+    int hi;
+} FieldSel;
+
+typedef struct
+{
+    Filter f;
+    FieldSel* sel;
+    int num_sel;
+    int need;            // fields past this one aren't looked at
+    int delim;           // -1: runs of blanks, awk style
+    char* ofs;
+    const char** beg;    // where the fields of the line at hand are
+    const char** end;
+    int cap;
+} FieldsF;
+
+/* tr's tables: what a byte turns into, and whether it is
+ * deleted or squeezed (0xff) */
+typedef struct
+{
+    Filter f;
+    int translate;
+    int del;
+    int sq;
+    int last;            // squeezing goes on across blocks
+    unsigned char map[256];
+    unsigned char dmap[256];
+    unsigned char smap[256];
+} TrF;
+
+typedef struct
+{
+    Filter f;
+    char* pat;
+    size_t len;
+    int invert;
+    int count;
+    unsigned long long n;
+} GrepF;
+
+typedef struct
+{
+    Filter f;
+    long long left;      // lines still to go
+} HeadF;
+
+/* the head of a line index file, what it was made from first:
+ * it is only good while those still match the file */
+typedef struct
+{
+    char magic[8];
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    long long mtime;
+    long long mtime_ns;
+    unsigned long long lines;    // newlines in the file
+    unsigned long long step;
+    unsigned long long num;      // offsets that follow
+} LineIdxHead;
+
+typedef struct
+{
+    LineIdxHead head;
+    unsigned long long* offs;    // offs[k]: where line k * step + 1 starts
+} LineIdx;
+
+typedef struct
+{
+    Filter f;
+    char* path;
+    int mode;            // 'n' a range, 't' the tail, 'p' a part, 'c' the count
+    unsigned long long a;
+    unsigned long long b;
+} LinesF;
+
+typedef struct
+{
+    Filter f;
+    long long first;
+    long long incr;
+    long long last;
+} SeqF;
+
+/* what a worker of stage_split() puts out, kept until it is
+ * the worker's turn to hand it on */
+typedef struct
+{
+    Filter f;
+    char* buf;
+    size_t len;
+    size_t cap;
+} CollectF;
+
+typedef struct
+{
+    Filter** fs;         // its own copies of the split stages
+    int m;
+    CollectF* out;
+    char* beg;           // this round's range
+    char* end;
+    char* tail;          // the file's last line, given its newline
+    size_t tail_len;
+    int last;            // the last round, the stages are finished
+    int status;
+} Worker;
+
+/*
+ * builtin stages with external ones on both sides don't need
+ * a process of their own, only the pipes. they run inside the
+ * shell as a coroutine of the event loop: a task reads what its
+ * input pipe has, pushes it through its filters, writes what
+ * comes out and goes back to the loop when either pipe would
+ * block. while the output pipe is full it reads nothing, so
+ * what it holds is bounded by the buffers. it is all on the
+ * shell's one thread, nothing needs a lock
+ *
+ * only foreground pipelines get tasks, the shell waits for those
+ * anyway. a background one may run for longer than the shell,
+ * like its children do, so its stages are forked as usual
+ * */
+typedef struct Task
+{
+    Job* job;
+    int stage;           // it runs job->runs[stage] to [stage+stages-1]
+    int stages;
+    Filter** fs;
+    int n;               // filters set up, fewer than stages if one failed
+    Blocks in;
+    int fd_out;
+    int eof;             // the input is over, only the output is left
+    int status;
+    int killed;          // job_kill()'s signal, taken on the next step
+    int watch;           // the fd we wait for, -1 for none
+    int timer;           // a step is coming up from the timers
+    long long t_start;
+    long long cpu;       // ns the steps took, for stats
+    long long cpu_mark;  // the thread's cpu time when this step started
+    struct Task* next;
+} Task;
+
+/* a pipeline that watch-run re-runs when its paths change */
+typedef struct Watch
+{
+    int id;
+    char* line;
+    char** paths;
+    int num_paths;
+    int* wds;
+    long long debounce;
+    int timer;
+    int job;             // the run in flight, 0 if none
+    int again;           // something changed while it was running
+    struct Watch* next;
+} Watch;
+
+/* a pipeline scheduled with every or at */
+typedef struct Sched
+{
+    int id;
+    char* line;
+    long long period;    // 0 for at
+    long long due;       // now_ns() time of the next run
+    int overlap;
+    int timer;
+    int job;             // the run in flight, 0 if none
+    int pending;         // runs owed to the pipeline once it is done
+    struct Sched* next;
+} Sched;
+
+/* a pipeline under retry, between attempts it only has a timer */
+typedef struct Retry
+{
+    int id;
+    char* line;
+    int bg;
+    int tries;           // attempts allowed in all
+    int attempt;         // the one running or coming up, from 1
+    long long backoff;   // wait before the 2nd attempt, doubles each time
+    long long max;       // up to this
+    int timer;
+    int job;
+    struct Retry* next;
+} Retry;
+
 int bg;
 int fd;
 int backup;
 char* fname;
+int interactive;
+int quitting;
+
+/* input is read by hand instead of with getline(),
+ * stdio buffering and epoll don't get along */
+char* inbuf;
+size_t in_len;
+size_t in_off;
+size_t in_cap;
+int in_eof;
+int stdin_polled;
+
+int epfd;
+EvWatch* ev_watches;
+int ev_cap;
+int sig_fd;
+int timer_fd;
+Timer* timers;
+int num_timers;
+int cap_timers;
+int timer_ids;
+sigset_t child_mask;
+
+Job* jobs;
+int job_ids;
+int num_jobs;
+
+Proc* procs;
+int num_procs;
+int cap_procs;
+
+StatSlot* stat_tab;
+unsigned int stat_cap;
+unsigned int stat_len;
+
+unsigned long long n_commands;
+unsigned long long n_forks;
+unsigned long long n_reaped;
+Hist spawn_hist;
+char* metrics_file;
+char* metrics_sock;
+int metrics_ival;
+
+/* the json log is buffered and flushed from a timer
+ * (or when the buffer fills up), never in the middle
+ * of starting or reaping a command. flushing only hands
+ * the buffer to a writer thread (jlog_out), the shell
+ * never waits for the log's file system */
+int jlog_fd = -1;
+char* jlog_buf;
+size_t jlog_len;
+size_t jlog_cap;
+int jlog_timer;
+char* jlog_out;          // the writer's, while jlog_out_len isn't 0
+size_t jlog_out_len;
+size_t jlog_out_cap;
+int jlog_stop;
+unsigned long long jlog_dropped;
+pthread_t jlog_thread;
+pthread_mutex_t jlog_mu = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jlog_cv = PTHREAD_COND_INITIALIZER;
+
+/* the background job pool. off: everything starts right away,
+ * fixed: at most pool_limit at a time, auto: pool_limit moves
+ * up and down with the pressure stall information */
+#define POOL_OFF 0
+#define POOL_FIXED 1
+#define POOL_AUTO 2
+int pool_mode;
+int pool_limit;
+int pool_running;
+int pool_queued;
+double pool_target;
+int pool_timer;
+char* psi_path[3];
+unsigned long long psi_total[3];
+double psi_pct[3];
+long long psi_t;
+
+Prio bg_prio;
+int no_clone3;
+
+extern char** environ;
+
+/* environ copied into one block, handed to execve() as it is
+ * until export or unset bump env_gen */
+char** envp;
+int env_gen;
+int envp_gen;
+
+PathSlot* path_tab;
+unsigned int path_cap;
+unsigned int path_len;
+unsigned long long path_hits;
+unsigned long long path_misses;
+
+/* at eof the shell sticks around while this is
+ * non-zero, e.g. for watch-run */
+int keepalive;
+
+/* parser arenas alive right now, for memstats */
+size_t arena_live;
+size_t arena_peak;
+int arena_count;
+int arena_huge;
+
+int ino_fd = -1;
+Watch* watches;
+int watch_ids;
+
+Sched* scheds;
+int sched_ids;
+
+Retry* retries;
+int retry_ids;
+
+Task* tasks;
 
 void loop(void);
+void on_stdin(int fd, unsigned int events, void* ctx);
+int fill_input(void);
 char* get_cmd(void);
-FullCommand* cmd_builder(char* line);
-int execute_cmd(FullCommand* cmd, int bg_flag);
+int run_line(char* in);
+int run_pipeline(char* in, int bg_flag, void (*on_done)(Job* job, void* ctx), void* ctx, int* job_id);
+FullCommand* cmd_builder(char* in);
+void free_cmd(FullCommand* cmd);
+void* arena_alloc(size_t len);
+void arena_free(void* p, size_t len);
+void huge_advise(void* p, size_t len);
+Job* job_new(FullCommand* cmd, int bg_flag);
+void job_free(Job* job);
+void wait_job(Job* job);
+int execute_cmd(Job* job);
+void on_sigchld(int fd, unsigned int events, void* ctx);
+int spawn(int cgfd, int* pidfd, int host);
+void on_pidfd(int fd, unsigned int events, void* ctx);
+void proc_add(int pid, int pidfd, long long t_spawn, CmdStats* st, Job* job, int stage, int stages);
+void reap_child(int pid, int status, struct rusage* ru);
+long long now_ns(void);
+void ev_init(void);
+int ev_add(int fd, unsigned int events, EvFunc func, void* ctx);
+void ev_del(int fd);
+void ev_run(int block);
+int ev_timer(long long delay_ns, TimerFunc func, void* ctx);
+void ev_timer_cancel(int id);
+void timer_remove(int i);
+void timer_arm(void);
+void on_timerfd(int fd, unsigned int events, void* ctx);
+int metrics_init(void);
+char* metrics_format(size_t* len);
+void metrics_tick(void* ctx);
+void metrics_write_file(void);
+void on_metrics_accept(int fd, unsigned int events, void* ctx);
+void on_metrics_conn(int fd, unsigned int events, void* ctx);
+void metrics_idle(void* ctx);
+void jlog_job(Job* job);
+void jlog_printf(const char* fmt, ...);
+void jlog_str(const char* s);
+void jlog_flush(void);
+void jlog_tick(void* ctx);
+void jlog_start(void);
+void jlog_close(void);
+void* jlog_writer(void* arg);
+void jlog_write(const char* p, size_t len);
+int utf8_len(const unsigned char* s);
+void usage(void);
+int sh_jobs(Command* cmd);
+int sh_pool(Command* cmd);
+void pool_dispatch(void);
+void pool_tick(void* ctx);
+int psi_read(char* path, unsigned long long* total);
+void psi_sample(void);
+int prio_parse(FullCommand* cmd);
+void prio_apply(Prio* p);
+void prio_print(char* what, Prio* p);
+unsigned int hash_str(const char* s);
+char** env_snapshot(void);
+char* path_lookup(char* name);
+void path_flush(void);
+int sh_export(Command* cmd);
+int sh_unset(Command* cmd);
+int sh_hash(Command* cmd);
+Job* job_find(int id);
+void job_kill(Job* job, int sig);
+int sh_watch_run(char* line);
+void watch_add_paths(Watch* w);
+void watch_start(Watch* w);
+void watch_fire(void* ctx);
+void watch_done(Job* job, void* ctx);
+void watch_free(Watch* w);
+void on_inotify(int fd, unsigned int events, void* ctx);
+long long parse_duration(char* s);
+int sh_every(char* line);
+int sh_at(char* line);
+char* sched_rest(char* line);
+int sched_admin(char* line, char* name);
+Sched* sched_new(char* line, long long delay);
+void sched_fire(void* ctx);
+void sched_start(Sched* s);
+void sched_done(Job* job, void* ctx);
+void sched_free(Sched* s);
+int sh_retry(char* line);
+Retry* retry_find(int id);
+void retry_start(void* ctx);
+void retry_done(Job* job, void* ctx);
+void retry_free(Retry* r);
+int sh_memstats(Command* cmd);
+long rss_kb(void);
+Stage* stage_find(char* name);
+int stage_probe(Command* cmd);
+int stage_run(Command* cmds, int n);
+int stage_split(Command* cmds, Filter** fs, int n, int* status);
+void* split_part(void* arg);
+int collect_push(Filter* f, char* p, size_t n);
+int collect_finish(Filter* f);
+int task_able(Command* cmds, int n, int fd_in);
+void task_start(Job* job, int stage, int n, int fd_in, int fd_out);
+void task_step(Task* t);
+int task_run(Task* t);
+long long thread_cpu_ns(void);
+void task_resume(void* ctx);
+void on_task(int fd, unsigned int events, void* ctx);
+void task_wait(Task* t, int fd, unsigned int events);
+void task_end(Task* t, int status);
+void* filter_new(size_t size, int (*push)(Filter* f, char* p, size_t n), int (*finish)(Filter* f));
+void out_init(Out* o, int fd, Filter* next, size_t cap);
+void out_put(Out* o, const char* p, size_t n);
+void out_drain(Out* o, int all);
+int sort_open(Command* cmd, Filter** f);
+int sort_push(Filter* f, char* p, size_t n);
+int sort_finish(Filter* f);
+long long parse_size(char* s);
+const char* field_end(const char* s, const char* end, int delim);
+double parse_num(const char* s, const char* end);
+void line_key(SortKey* k, Line* l);
+int line_cmp(SortKey* k, const Line* a, const Line* b);
+int c_collate(void);
+int num_cmp(const char* a, const char* ae, const char* b, const char* be);
+void num_parts(const char* s, const char* end, NumParts* n);
+void line_sort(SortKey* k, Line* a, Line* tmp, size_t n);
+void* sort_part(void* arg);
+int sort_chunk(SortKey* k, const char* buf, size_t len, int threads, SortPart** parts);
+int src_next(SortKey* k, Source* s);
+void sort_merge(SortKey* k, Source* srcs, int num, Out* o);
+int sort_spill(SortKey* k, SortPart* parts, int n);
+int blk_open(Blocks* b, char** files, size_t cap, int raw);
+ssize_t blk_next(Blocks* b, int fill, char** p);
+int count_open(Command* cmd, Filter** f);
+int count_push(Filter* f, char* p, size_t n);
+int count_finish(Filter* f);
+unsigned long long hash_mem(const char* p, size_t n);
+void count_add(CountTab* t, const char* key, size_t len, unsigned long long hash,
+               unsigned long long n, int copy);
+void* count_part(void* arg);
+int count_cmp(const void* a, const void* b);
+int count_cmp_coll(const void* a, const void* b);
+int fields_open(Command* cmd, Filter** f);
+int fields_parse(FieldsF* fs, char* list);
+int fields_push(Filter* f, char* p, size_t n);
+int fields_finish(Filter* f);
+void fields_close(Filter* f);
+int tr_open(Command* cmd, Filter** f);
+int tr_push(Filter* f, char* p, size_t n);
+int tr_finish(Filter* f);
+int tr_set(const char* s, unsigned char* out, int max);
+int tr_char(const char** sp);
+void tr_translate(const unsigned char* map, unsigned char* p, size_t n);
+size_t tr_delete(const unsigned char* del, unsigned char* p, size_t n);
+int grep_open(Command* cmd, Filter** f);
+int grep_push(Filter* f, char* p, size_t n);
+int grep_finish(Filter* f);
+int head_open(Command* cmd, Filter** f);
+int head_push(Filter* f, char* p, size_t n);
+int head_finish(Filter* f);
+int lines_open(Command* cmd, Filter** f);
+int lines_push(Filter* f, char* p, size_t n);
+int lines_finish(Filter* f);
+void lidx_load(LineIdx* x, char* path, struct stat* sb, const char* map);
+void lidx_build(LineIdx* x, const char* p, size_t n);
+size_t lidx_line(LineIdx* x, const char* map, size_t size, unsigned long long line);
+unsigned long long lidx_num(unsigned long long lines, const char* map, size_t size);
+int lidx_check(const unsigned long long* offs, unsigned long long num, const char* map, size_t size);
+int seq_open(Command* cmd, Filter** f);
+int seq_push(Filter* f, char* p, size_t n);
+int seq_finish(Filter* f);
+int fmt_num(char* p, long long v);
+int run_builtin(FullCommand* cmd);
+int sh_quit(Command* cmd);
+int sh_stats(Command* cmd);
+void hist_add(Hist* h, unsigned long long v);
+unsigned long long hist_pct(Hist* h, double p);
+unsigned long long hist_lo(int idx);
+CmdStats* stats_get(char* argv0);
+void fmt_us(char* buf, size_t n, unsigned long long us);
 void print_command(FullCommand* cmd);
 
+Builtin builtins[] = {
+    { "quit", sh_quit },
+    { "stats", sh_stats },
+    { "jobs", sh_jobs },
+    { "pool", sh_pool },
+    { "export", sh_export },
+    { "unset", sh_unset },
+    { "hash", sh_hash },
+    { "memstats", sh_memstats },
+};
+
+Stage stages[] = {
+    { "sort", sort_open, 0 },
+    { "count", count_open, 0 },
+    { "fields", fields_open, 1 },
+    { "tr", tr_open, 1 },
+    { "grep", grep_open, 1 },
+    { "head", head_open, 1 },
+    { "lines", lines_open, 0 },
+    { "seq", seq_open, 0 },
+};
+
+LineBuiltin line_builtins[] = {
+    { "watch-run", sh_watch_run },
+    { "every", sh_every },
+    { "at", sh_at },
+    { "retry", sh_retry },
+};
+
 int main(int argc, char* argv[])
 {
     /* i decided to add some abstraction
      * and break down the program into
      * functions and all kinds of cute stuff */
 
+    int opt;
+    metrics_ival = 15;
+    while ((opt = getopt(argc, argv, "m:M:i:j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jlog_fd = open(optarg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+            if (jlog_fd == -1) {
+                perror("nsh");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'M':
+            metrics_sock = optarg;
+            break;
+        case 'i':
+            metrics_ival = atoi(optarg);
+            if (metrics_ival > 0)
+                break;
+            // fall through
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
     // output file management
     fd = -1;
-    if (argc == 1) {
+    if (optind == argc) {
         // no output file
-    } else if (argc == 2) {
+    } else if (optind == argc - 1) {
         // yes output file
-        fd = open(argv[1], O_WRONLY | O_APPEND | O_CREAT, 0666);
+        fd = open(argv[optind], O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
         if (fd == -1) {
             perror("nsh");
             return EXIT_FAILURE;
         }
         backup = 1;
-        fname = argv[1];
+        fname = argv[optind];
     } else {
-        fprintf(stderr, "nsh usage: \'./nsh filename\'\n");
+        usage();
         return EXIT_FAILURE;
     }
 
+    ev_init();
+    if (metrics_init() == -1)
+        return EXIT_FAILURE;
+    if (jlog_fd != -1)
+        jlog_start();   // after ev_init(), the thread has to block its signals too
+
     // the command loop
     loop();
 
+    if (metrics_file)
+        metrics_write_file();
+    if (metrics_sock)
+        unlink(metrics_sock);
+    if (jlog_fd != -1)
+        jlog_close();
     if (fd != -1)
         close(fd);
     return EXIT_SUCCESS;
 }
 
+void usage(void)
+{
+    fprintf(stderr, "nsh usage: \'./nsh [-m metrics.prom] [-M metrics.sock] [-i seconds] [-j log.jsonl] [filename]\'\n");
+}
+
 void loop(void)
 {
-    /* the command loop of the shell */
+    /* the command loop of the shell
+     *
+     * everything happens in callbacks of the event loop,
+     * this just keeps it going until quit or eof. stdin is
+     * watched one-shot, so that it stays quiet while a
+     * foreground job runs the loop to wait for its children.
+     * a regular file can't be watched with epoll, in that
+     * case it is simply read whenever the loop comes around */
 
-    FullCommand* cmd;
-    char* in;
-    int status;
+    interactive = isatty(0);
+    stdin_polled = ev_add(0, EPOLLIN | EPOLLONESHOT, on_stdin, NULL) == 0;
 
-    do {
+    if (interactive) {
         fprintf(stdout, "> ");
-        in = get_cmd();
+        fflush(stdout);
+    }
 
-        if (backup) {
-            write(fd, "> ", 3);
-            write(fd, in, strlen(in) + 1);
-            write(fd, "\n", 2);
+    /* queued background jobs, watches and such still get to run after eof */
+    while (!quitting && (!in_eof || pool_queued > 0 || keepalive > 0)) {
+        if (stdin_polled || in_eof) {
+            ev_run(1);
+        } else {
+            ev_run(0);
+            on_stdin(0, EPOLLIN, NULL);
         }
+    }
+}
+
+void on_stdin(int fd, unsigned int events, void* ctx)
+{
+    char* in;
+    (void)fd;
+    (void)events;
+    (void)ctx;
+
+    if (fill_input() == 0)
+        in_eof = 1;
+
+    while (!quitting && (in = get_cmd()) != NULL) {
+        if (!run_line(in))
+            quitting = 1;
+    }
+
+    if (quitting || in_eof) {
+        // eof, e.g. the end of a script in batch mode
+        if (stdin_polled)
+            ev_del(0);
+        if (in_eof && interactive)
+            fprintf(stdout, "\n");
+        return;
+    }
+
+    if (stdin_polled) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = 0;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, 0, &ev);
+    }
+
+    if (interactive) {
+        fprintf(stdout, "> ");
+        fflush(stdout);
+    }
+}
+
+/* read whatever stdin has for us into inbuf,
+ * returns 0 on eof */
 
-        cmd = cmd_builder(in);
-        status = execute_cmd(cmd, bg);
+int fill_input(void)
+{
+    if (in_off > 0) {
+        memmove(inbuf, inbuf + in_off, in_len - in_off);
+        in_len -= in_off;
+        in_off = 0;
+    }
+    if (in_cap - in_len < 4096) {
+        in_cap = in_cap ? in_cap * 2 : 65536;
+        inbuf = (char*)realloc(inbuf, in_cap);
+        if (!inbuf) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+        if (in_cap >= ARENA_HUGE)
+            huge_advise(inbuf, in_cap);
+    }
 
-        // freeing up the command
-        for (int x = 0; x < 16; x++)
-            free(cmd->cmds[x].args);
-        free(cmd->cmds);
-        free(cmd);
-    } while (status);
+    ssize_t n = read(0, inbuf + in_len, in_cap - in_len - 1);
+    if (n < 0)
+        return errno == EINTR || errno == EAGAIN ? -1 : 0;
+    in_len += n;
+    return n;
 }
 
 char* get_cmd(void)
 {
     /* fgets() from simple_shell.c is deprecated,
-     * so i used getline() to read input */
+     * so i used getline() to read input
+     *
+     * ...and then getline() had to go as well, see inbuf.
+     * returns the next complete line from the buffer, or
+     * NULL if there isn't one yet. at eof the last line
+     * doesn't need a newline */
+
+    char* line = inbuf + in_off;
+    char* nl;
+    size_t len;
 
-    char* line = NULL;
-    size_t bsize = 0;
-    getline(&line, &bsize, stdin);
+    if (in_off == in_len)
+        return NULL;
 
-    line[strlen(line)-1] = '\0';
+    nl = (char*)memchr(line, '\n', in_len - in_off);
+    if (nl != NULL) {
+        len = nl - line;
+        in_off += len + 1;
+    } else if (in_eof) {
+        len = in_len - in_off;
+        in_off = in_len;
+    } else {
+        return NULL;
+    }
+    line[len] = '\0';
 
-    if (line[strlen(line)-1] == '&') {
+    bg = 0;
+    if (len > 0 && line[len-1] == '&') {
         bg = 1;
-        line[strlen(line)-1] = '\0';
+        line[--len] = '\0';
     }
 
     return line;
 }
 
+/* parse one line and run it, returns 0 if the shell should quit */
+
+int run_line(char* in)
+{
+    PROBE2(line_read, in, (int)strlen(in));
+
+    if (backup) {
+        write(fd, "> ", 3);
+        write(fd, in, strlen(in) + 1);
+        write(fd, "\n", 2);
+    }
+
+    for (size_t b = 0; b < sizeof(line_builtins) / sizeof(line_builtins[0]); b++) {
+        size_t len = strlen(line_builtins[b].name);
+        if (strncmp(in, line_builtins[b].name, len) == 0 && (in[len] == ' ' || in[len] == '\0'))
+            return line_builtins[b].func(in + len);
+    }
+
+    return run_pipeline(in, bg, NULL, NULL, NULL);
+}
+
+/*
+ * run_pipeline() parses a pipeline and starts it, shell builtins
+ * just run. a foreground one is waited for, a background one may
+ * have to wait for the pool. on_done is called when the job is
+ * over (not for builtins), with only the job's id and status still
+ * good to look at. the job's id goes to *job_id.
+ * returns 0 if the shell should quit
+ * */
+
+int run_pipeline(char* in, int bg_flag, void (*on_done)(Job* job, void* ctx), void* ctx, int* job_id)
+{
+    /* the job outlives this line if it goes to
+     * the background, so cmd has its own copy */
+    FullCommand* cmd = cmd_builder(in);
+
+    if (job_id)
+        *job_id = 0;
+
+    if (cmd->cmds->args[0] == NULL && cmd->num_cmds == 1 + (backup != 0)) {
+        // empty line, nothing to do (but tee for the backup)
+        free_cmd(cmd);
+        return 1;
+    }
+
+    for (int i = 0; i < cmd->num_cmds; i++) {
+        if (cmd->cmds[i].args[0] == NULL) {
+            // "ls |", "ls | | wc": a stage with nothing to run
+            fprintf(stderr, "nsh: syntax error near '|'\n");
+            free_cmd(cmd);
+            return 1;
+        }
+    }
+
+    if (strcmp(cmd->cmds->args[0], "prio") == 0
+        && (prio_parse(cmd) == -1 || cmd->cmds->args[0] == NULL)) {
+        // bad options, or only the defaults were changed
+        free_cmd(cmd);
+        return 1;
+    }
+
+    for (size_t b = 0; b < sizeof(builtins) / sizeof(builtins[0]); b++) {
+        if (strcmp(cmd->cmds->args[0], builtins[b].name) == 0) {
+            int ret = run_builtin(cmd);
+            free_cmd(cmd);
+            return ret;
+        }
+    }
+
+    Job* job = job_new(cmd, bg_flag);
+    job->on_done = on_done;
+    job->done_ctx = ctx;
+    if (job_id)
+        *job_id = job->id;
+    if (job->bg && pool_mode != POOL_OFF && pool_running >= pool_limit) {
+        job->queued = 1;
+        pool_queued++;
+        return 1;
+    }
+    execute_cmd(job);
+    if (!job->bg)
+        wait_job(job);
+    return 1;
+}
+
 /*
  * cmd_builder() takes in the whole input line
  * and breaks it down into tokens, which are
@@ -142,6 +1312,11 @@ char* get_cmd(void)
  *
  * it uses strtok with some array index manipulation
  *
+ * everything, the copy of the line included, goes in one
+ * arena that is sized by a first pass over the line, so
+ * there is no limit on commands or arguments and a line
+ * costs one malloc (or one mmap when it is a huge one)
+ *
  * the advantage of this is that it is very simple now
  * to combine pipes and i/o redirection, and, in general,
  * it makes my code a lot cleaner
@@ -150,70 +1325,90 @@ char* get_cmd(void)
  * it will just add a pipe to tee at the end
  * */
 
-FullCommand* cmd_builder(char* line)
+FullCommand* cmd_builder(char* in)
 {
-    FullCommand* fcmdp = (FullCommand*)malloc(sizeof(FullCommand));
-    fcmdp->cmds = (Command*)malloc(16 * sizeof(Command));
-    for (int x = 0; x < 16; x++)
-        fcmdp->cmds[x].args = (char**)malloc(101 * sizeof(char*));
+    long long t_parse = now_ns();
+    PROBE1(parse_start, in);
 
-    int bsize = TKS_BUFFER_SIZE;
-    int pos = 0;
-    char** toks = (char**)malloc(bsize * sizeof(char*));
-    char* tok;
+    size_t len = strlen(in);
+    int num_toks = 0;
+    int num_pipes = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] != ' ' && (i == 0 || in[i-1] == ' ')) {
+            num_toks++;
+            if (in[i] == '|' && (in[i+1] == ' ' || in[i+1] == '\0'))
+                num_pipes++;
+        }
+    }
 
+    /* a slot per token (a "|" turns into its command's NULL),
+     * one for the last NULL, and tee's 4 for the backup */
+    int max_cmds = num_pipes + 2;
+    size_t num_slots = num_toks + 5;
+    size_t size = sizeof(FullCommand) + max_cmds * sizeof(Command)
+                + num_slots * sizeof(char*) + len + 1;
+    char* arena = (char*)arena_alloc(size);
+
+    FullCommand* fcmdp = (FullCommand*)arena;
+    fcmdp->cmds = (Command*)(arena + sizeof(FullCommand));
+    for (int x = 0; x < max_cmds; x++) {
+        fcmdp->cmds[x].args = NULL;
+        fcmdp->cmds[x].num_args = 0;
+    }
+    fcmdp->cmds[0].args = (char**)(fcmdp->cmds + max_cmds);
+    fcmdp->overwrite = 0;
+    fcmdp->prio.set = 0;
+    fcmdp->arena_len = size;
+
+    char* line = (char*)(fcmdp->cmds[0].args + num_slots);
+    memcpy(line, in, len + 1);
+
+    char* tok;
+    char* prev = NULL;
     int num_cmd = 0;
     int offset = 0;
     char* file_in = NULL;
     char* file_out = NULL;
 
-    if (!toks) {
-        fprintf(stderr, "nsh: malloc error\n");
-        exit(EXIT_FAILURE);
-    }
-
     tok = strtok(line, " ");
     while (tok != NULL) {
 
-        toks[pos] = tok;
         fcmdp->cmds[num_cmd].args[offset] = tok;
 
         if (strcmp(tok, "|") == 0) {
             /* pipeline detected:
              * shift to the next command in the line*/
             fcmdp->cmds[num_cmd].args[offset] = NULL;
+            fcmdp->cmds[num_cmd+1].args = fcmdp->cmds[num_cmd].args + offset + 1;
             offset = 0;
             num_cmd++;
-            pos++;
-        } else if (pos > 0 && strcmp(toks[pos-1], ">") == 0) {
+        } else if (prev != NULL && strcmp(prev, ">") == 0) {
             /* output file (overwrite) detected */
             file_out = tok;
             fcmdp->cmds[num_cmd].args[offset-1] = NULL;
             fcmdp->overwrite = 1;
-            pos++;
-        } else if (pos > 0 && strcmp(toks[pos-1], "<") == 0) {
+        } else if (prev != NULL && strcmp(prev, "<") == 0) {
             /* input file detected */
             file_in = tok;
             fcmdp->cmds[num_cmd].args[offset-1] = NULL;
-            pos++;
-        } else if (pos > 0 && strcmp(toks[pos-1], ">>") == 0) {
+        } else if (prev != NULL && strcmp(prev, ">>") == 0) {
             /* output file (append) detected */
             file_out = tok;
             fcmdp->cmds[num_cmd].args[offset-1] = NULL;
             fcmdp->overwrite = 0;
-            pos++;
         } else {
-            pos++;
             offset++;
             fcmdp->cmds[num_cmd].num_args++;
         }
 
+        prev = tok;
         tok = strtok(NULL, " ");
     }
 
     fcmdp->cmds[num_cmd].args[offset] = NULL;
 
     if (backup) {
+        fcmdp->cmds[num_cmd+1].args = fcmdp->cmds[num_cmd].args + offset + 1;
         offset = 0;
         num_cmd++;
         fcmdp->cmds[num_cmd].args[offset++] = "tee";
@@ -226,50 +1421,236 @@ FullCommand* cmd_builder(char* line)
     fcmdp->file_in = file_in;
     fcmdp->file_out = file_out;
 
-    /* we actually don't need toks, because
-     * we only used it to create FullCommand */
-    free(toks);
-
+    PROBE2(parse_done, fcmdp->num_cmds, now_ns() - t_parse);
     return fcmdp;
 }
 
-int execute_cmd(FullCommand* cmd, int bg_flag)
+void free_cmd(FullCommand* cmd)
 {
-    if (strcmp(cmd->cmds->args[0], "quit") == 0) {
-        return 0;
-    }
+    arena_free(cmd, cmd->arena_len);
+}
 
-    /* save stdin and stdout
-     * to restore them later */
-    int tin = dup(0);
-    int tout = dup(1);
+/* small arenas are plain malloc. a big one is rounded up to whole
+ * huge pages and mapped from the reserved ones if there are any,
+ * otherwise it asks for transparent huge pages, so that walking a
+ * million argv pointers doesn't take a tlb miss every 512 of them */
 
-    /* check first if there is an input file
-     * if there is not, use stdin */
+void* arena_alloc(size_t len)
+{
+    void* p;
 
-    int fd_in, fd_out;
+    arena_live += len;
+    if (arena_live > arena_peak)
+        arena_peak = arena_live;
+    arena_count++;
+
+    if (len < ARENA_HUGE) {
+        p = malloc(len);
+        if (!p) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+        return p;
+    }
+
+    arena_huge++;
+    len = (len + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1);
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("nsh");
+            exit(EXIT_FAILURE);
+        }
+        huge_advise(p, len);
+    }
+    return p;
+}
+
+void arena_free(void* p, size_t len)
+{
+    arena_live -= len;
+    arena_count--;
+    if (len < ARENA_HUGE) {
+        free(p);
+    } else {
+        arena_huge--;
+        munmap(p, (len + ARENA_HUGE - 1) & ~(size_t)(ARENA_HUGE - 1));
+    }
+}
+
+/* madvise() wants whole pages, p and len need not be */
+
+void huge_advise(void* p, size_t len)
+{
+    uintptr_t pg = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)p + pg - 1) & ~(pg - 1);
+    uintptr_t end = ((uintptr_t)p + len) & ~(pg - 1);
+
+    if (end > start)
+        madvise((void*)start, end - start, MADV_HUGEPAGE);
+}
+
+Job* job_new(FullCommand* cmd, int bg_flag)
+{
+    Job* job = (Job*)calloc(1, sizeof(Job));
+    if (!job) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    job->id = ++job_ids;
+    job->cmd = cmd;
+    job->bg = bg_flag;
+    job->t_start = now_ns();
+    job->runs = (StageRun*)calloc(cmd->num_cmds, sizeof(StageRun));
+    if (jlog_fd != -1) {
+        clock_gettime(CLOCK_REALTIME, &job->t_real);
+        job->cwd = getcwd(NULL, 0);
+    }
+    job->next = jobs;
+    jobs = job;
+    num_jobs++;
+    return job;
+}
+
+void job_free(Job* job)
+{
+    for (Job** j = &jobs; *j; j = &(*j)->next) {
+        if (*j == job) {
+            *j = job->next;
+            break;
+        }
+    }
+    num_jobs--;
+    if (job->bg && !job->queued)
+        pool_running--;
+    if (jlog_fd != -1)
+        jlog_job(job);
+    free_cmd(job->cmd);
+    free(job->runs);
+    free(job->cwd);
+
+    // last, it may well start the next job
+    if (job->on_done)
+        job->on_done(job, job->done_ctx);
+    free(job);
+}
+
+Job* job_find(int id)
+{
+    for (Job* job = jobs; job; job = job->next) {
+        if (job->id == id)
+            return job;
+    }
+    return NULL;
+}
+
+/* signal every child of a job, through the pidfd when
+ * there is one so that a recycled pid can't be hit */
+
+void job_kill(Job* job, int sig)
+{
+    for (int i = 0; i < num_procs; i++) {
+        if (procs[i].job != job)
+            continue;
+        if (procs[i].pidfd != -1)
+            syscall(SYS_pidfd_send_signal, procs[i].pidfd, sig, NULL, 0);
+        else
+            kill(procs[i].pid, sig);
+    }
+    // a task dies on its next step, not under the caller's feet
+    for (Task* t = tasks; t; t = t->next) {
+        if (t->job == job && !t->killed) {
+            t->killed = sig;
+            if (!t->timer)
+                t->timer = ev_timer(0, task_resume, t);
+        }
+    }
+}
+
+/* a foreground job keeps the event loop going until
+ * all its children are reaped, timers and metrics
+ * don't stop just because something is running */
+
+void wait_job(Job* job)
+{
+    while (job->running > 0)
+        ev_run(1);
+    job_free(job);
+}
+
+int execute_cmd(Job* job)
+{
+    FullCommand* cmd = job->cmd;
+    n_commands++;
+    if (job->bg)
+        pool_running++;
+
+    /* check first if there is an input file
+     * if there is not, use stdin
+     *
+     * a bad file only fails this command, the
+     * shell itself has to keep running */
+
+    int fd_in, fd_out;
     if (cmd->file_in != NULL) {
-        fd_in = open(cmd->file_in, O_RDONLY, 0444);
+        fd_in = open(cmd->file_in, O_RDONLY | O_CLOEXEC, 0444);
         if (fd_in < 0) {
             perror("nsh");
-            exit(EXIT_FAILURE);
+            job->status = 1 << 8;   // as if it exited with 1
+            if (job->bg) {
+                job_free(job);
+                pool_dispatch();   // its slot is free again
+            }
+            return 1;
         }
     } else {
-        fd_in = dup(tin);
+        fd_in = 0;
     }
 
-    int pid;
-    int status;
     int num_cmds = cmd->num_cmds;
+    int pid;
+    int pidfd;
+
+    Prio* prio = NULL;
+    if (cmd->prio.set)
+        prio = &cmd->prio;
+    else if (job->bg && bg_prio.set)
+        prio = &bg_prio;
 
-    /* process each command in the pipeline */
+    /* all the lookups happen here in the parent, the
+     * child gets everything ready-made for execve() */
+    char** env = env_snapshot();
+
+    int cgfd = -1;
+    if (prio && (prio->set & SET_CGROUP)) {
+        cgfd = open(prio->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgfd == -1)
+            perror("nsh: prio");
+    }
+
+    /*
+     * process each command in the pipeline
+     *
+     * the shell's own stdin and stdout are left alone, the child
+     * moves its ends of things onto 0 and 1 itself. everything
+     * the shell opens is close-on-exec, so the children only
+     * ever get 0, 1 and 2: a pipe with a forgotten write end
+     * somewhere never sees eof, and the downstream stage would
+     * wait for a producer that is long gone
+     * */
     for (int i = 0; i < num_cmds; i++) {
+        int next_in = -1;
 
-        // redirect input
-        dup2(fd_in, 0);
-        close(fd_in);
+        /* builtin stages next to each other are one child,
+         * i to last, that passes the data on in memory */
+        int builtin = stage_probe(&cmd->cmds[i]) >= 0;
+        int last = i;
+        while (builtin && last + 1 < num_cmds && stage_probe(&cmd->cmds[last+1]) == 0)
+            last++;
 
-        if (i == cmd->num_cmds - 1) {
+        if (last == num_cmds - 1) {
 
             /* last command, which means
              * we should check if there is
@@ -277,54 +1658,5210 @@ int execute_cmd(FullCommand* cmd, int bg_flag)
 
             if (cmd->file_out != NULL) {
                 if (cmd->overwrite) {
-                    fd_out = open(cmd->file_out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    fd_out = open(cmd->file_out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
                 } else {
-                    fd_out = open(cmd->file_out, O_WRONLY | O_APPEND | O_CREAT, 0666);
+                    fd_out = open(cmd->file_out, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
                 }
-                if (fd_in < 0) {
+                if (fd_out < 0) {
                     perror("nsh");
-                    exit(EXIT_FAILURE);
+                    fd_out = open("/dev/null", O_WRONLY | O_CLOEXEC);
                 }
             } else {
                 // or use stdout
-                fd_out = dup(tout);
+                fd_out = 1;
             }
         }
         else {
             // create a pipe for... well... pipelining, i guess
             int fds[2];
-            pipe(fds);
+            pipe2(fds, O_CLOEXEC);
             fd_out = fds[WRITE];
-            fd_in = fds[READ];
+            next_in = fds[READ];
         }
 
-        // redirect output
-        dup2(fd_out, 1);
-        close(fd_out);
+        /* with pipes (or files) on both sides they don't
+         * need a child at all, see Task */
+        if (builtin && !job->bg && prio == NULL && fd_in != 0 && fd_out != 1
+            && task_able(&cmd->cmds[i], last - i + 1, fd_in)) {
+            task_start(job, i, last - i + 1, fd_in, fd_out);
+            fd_in = next_in;
+            i = last;
+            continue;
+        }
 
-        pid = fork();
+        char* path = builtin ? NULL : path_lookup(cmd->cmds[i].args[0]);
+
+        long long t_spawn = now_ns();
+        pid = spawn(cgfd, &pidfd, builtin);
         if (pid == 0) {
             /* the child process */
-            if (execvp(cmd->cmds[i].args[0], cmd->cmds[i].args) == -1) {
+            if (fd_in != 0)
+                dup2(fd_in, 0);
+            if (fd_out != 1)
+                dup2(fd_out, 1);
+            // in case anything slipped through without O_CLOEXEC
+            syscall(SYS_close_range, 3, ~0U, 0);
+
+            sigprocmask(SIG_SETMASK, &child_mask, NULL);
+            if (prio)
+                prio_apply(prio);
+            if (builtin)
+                _exit(stage_run(&cmd->cmds[i], last - i + 1));
+            if (path != NULL)
+                execve(path, cmd->cmds[i].args, env);
+            /* not found, or the cached path went stale: a
+             * full PATH search has the final word on it */
+            if (execvpe(cmd->cmds[i].args[0], cmd->cmds[i].args, env) == -1) {
                 perror("nsh");
-                exit(EXIT_FAILURE);
+                // not exit(), that would flush the shell's stdio buffers a second time
+                _exit(EXIT_FAILURE);
+            }
+        } else if (pid < 0) {
+            perror("nsh");
+        } else {
+            long long fork_ns = now_ns() - t_spawn;
+            CmdStats* st = stats_get(cmd->cmds[i].args[0]);
+            hist_add(&st->spawn, fork_ns / 1000);
+            hist_add(&spawn_hist, fork_ns / 1000);
+            n_forks++;
+            proc_add(pid, pidfd, t_spawn, st, job, i, last - i + 1);
+            job->running++;
+            for (int s = i; s <= last; s++) {
+                job->runs[s].pid = pid;
+                job->runs[s].t_spawn = t_spawn;
+            }
+            PROBE3(spawn, pid, cmd->cmds[i].args[0], fork_ns);
+        }
+
+        // the child has its copies now
+        if (fd_in != 0)
+            close(fd_in);
+        if (fd_out != 1)
+            close(fd_out);
+        fd_in = next_in;
+        i = last;
+    }
+
+    if (cgfd != -1)
+        close(cgfd);
+
+    /* every stage is waited for, not just the last one,
+     * or the rest of the pipeline is left as zombies */
+    if (job->bg && job->running == 0) {
+        job_free(job);
+        pool_dispatch();
+    }
+
+    return 1;
+}
+
+/*
+ * spawn() is fork() for children that are going to exec.
+ * clone3() hands back a pidfd together with the pid, so
+ * there is no window where the pid could be reaped and
+ * reused before we hold on to it, and CLONE_INTO_CGROUP
+ * puts the child in the cgroup from its first instruction.
+ * without clone3 it is fork(), pidfd_open() and the child
+ * moving itself into the cgroup.
+ *
+ * the raw clone3() doesn't run glibc's fork handlers, which
+ * is fine as long as the child only sets itself up and
+ * execs. a host for a builtin stage keeps running our own
+ * code (malloc, threads), so it always gets a real fork()
+ * */
+
+int spawn(int cgfd, int* pidfd, int host)
+{
+    int pid;
+
+    *pidfd = -1;
+    if (!no_clone3 && !host) {
+        CloneArgs args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_PIDFD;
+        args.pidfd = (unsigned long long)(uintptr_t)pidfd;
+        args.exit_signal = SIGCHLD;
+        if (cgfd != -1) {
+            args.flags |= CLONE_INTO_CGROUP;
+            args.cgroup = cgfd;
+        }
+
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid != -1)
+            return pid;
+        if (errno == ENOSYS || errno == E2BIG)
+            no_clone3 = 1;
+        else if (cgfd == -1)
+            return -1;
+        /* with a cgroup it can be the cgroup clone3 doesn't
+         * like, the fallback below still gets a try at it */
+    }
+
+    pid = fork();
+    if (pid > 0) {
+        *pidfd = syscall(SYS_pidfd_open, pid, 0);
+    } else if (pid == 0 && cgfd != -1) {
+        int procs_fd = openat(cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (procs_fd == -1 || write(procs_fd, "0", 1) != 1)
+            perror("nsh: cgroup");
+        if (procs_fd != -1)
+            close(procs_fd);
+    }
+    return pid;
+}
+
+/* a child with a pidfd is reaped when its pidfd
+ * becomes readable, waitid() on the pidfd itself */
+
+void on_pidfd(int fd, unsigned int events, void* ctx)
+{
+    siginfo_t info;
+    struct rusage ru;
+    int status;
+    (void)events;
+    (void)ctx;
+
+    memset(&info, 0, sizeof(info));
+    if (syscall(SYS_waitid, P_PIDFD, fd, &info, WEXITED | WNOHANG, &ru) == -1
+        || info.si_pid == 0)
+        return;
+
+    if (info.si_code == CLD_EXITED)
+        status = (info.si_status & 0xff) << 8;
+    else
+        status = info.si_status | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+    reap_child(info.si_pid, status, &ru);
+}
+
+/* SIGCHLD arrives through a signalfd. it only has to
+ * deal with children we couldn't get a pidfd for, the
+ * others must be left for on_pidfd() */
+
+void on_sigchld(int fd, unsigned int events, void* ctx)
+{
+    struct signalfd_siginfo si;
+    int status;
+    struct rusage ru;
+    (void)events;
+    (void)ctx;
+
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+        ;
+    for (int i = num_procs - 1; i >= 0; i--) {
+        if (i < num_procs && procs[i].pidfd == -1
+            && wait4(procs[i].pid, &status, WNOHANG, &ru) > 0)
+            reap_child(procs[i].pid, status, &ru);
+    }
+}
+
+/* the table of live children, so that the reap
+ * side knows when each of them was started */
+
+void proc_add(int pid, int pidfd, long long t_spawn, CmdStats* st, Job* job, int stage, int stages)
+{
+    if (num_procs == cap_procs) {
+        cap_procs = cap_procs ? cap_procs * 2 : 16;
+        procs = (Proc*)realloc(procs, cap_procs * sizeof(Proc));
+        if (!procs) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    procs[num_procs].pid = pid;
+    procs[num_procs].pidfd = pidfd;
+    procs[num_procs].t_spawn = t_spawn;
+    procs[num_procs].st = st;
+    procs[num_procs].job = job;
+    procs[num_procs].stage = stage;
+    procs[num_procs].stages = stages;
+    num_procs++;
+
+    if (pidfd != -1)
+        ev_add(pidfd, EPOLLIN, on_pidfd, NULL);
+}
+
+void reap_child(int pid, int status, struct rusage* ru)
+{
+    for (int i = 0; i < num_procs; i++) {
+        if (procs[i].pid == pid) {
+            long long t_end = now_ns();
+            long long wall_ns = t_end - procs[i].t_spawn;
+            PROBE3(reap, pid, status, wall_ns);
+
+            unsigned long long cpu_us =
+                (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000ULL
+                + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+            hist_add(&procs[i].st->wall, wall_ns / 1000);
+            hist_add(&procs[i].st->cpu, cpu_us);
+            n_reaped++;
+
+            Job* job = procs[i].job;
+            int last = procs[i].stage + procs[i].stages - 1;
+            for (int s = procs[i].stage; s <= last; s++) {
+                job->runs[s].status = status;
+                job->runs[s].t_end = t_end;
+                job->runs[s].ru = *ru;
+            }
+            if (procs[i].pidfd != -1) {
+                ev_del(procs[i].pidfd);
+                close(procs[i].pidfd);
+            }
+            if (last == job->cmd->num_cmds - 1)
+                job->status = status;
+            procs[i] = procs[--num_procs];
+
+            // a foreground job is freed by whoever waits for it
+            if (--job->running == 0 && job->bg) {
+                job_free(job);
+                pool_dispatch();
+            }
+            return;
+        }
+    }
+}
+
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* builtins run inside the shell itself, only
+ * output redirection is honoured for them */
+
+int run_builtin(FullCommand* cmd)
+{
+    int tout = -1;
+    int ret = 1;
+
+    if (cmd->file_out != NULL) {
+        int fd_out = open(cmd->file_out,
+                          O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->overwrite ? O_TRUNC : O_APPEND), 0666);
+        if (fd_out < 0) {
+            perror("nsh");
+            return 1;
+        }
+        fflush(stdout);
+        tout = fcntl(1, F_DUPFD_CLOEXEC, 3);
+        dup2(fd_out, 1);
+        close(fd_out);
+    }
+
+    for (size_t b = 0; b < sizeof(builtins) / sizeof(builtins[0]); b++) {
+        if (strcmp(cmd->cmds->args[0], builtins[b].name) == 0) {
+            ret = builtins[b].func(&cmd->cmds[0]);
+            break;
+        }
+    }
+
+    /* stdout is fully buffered when it isn't a terminal,
+     * and the children after us write to the fd directly */
+    fflush(stdout);
+    if (tout != -1) {
+        dup2(tout, 1);
+        close(tout);
+    }
+    return ret;
+}
+
+int sh_quit(Command* cmd)
+{
+    (void)cmd;
+    return 0;
+}
+
+/* jobs lists what is running or queued in the background */
+
+int sh_jobs(Command* cmd)
+{
+    (void)cmd;
+
+    for (Job* job = jobs; job; job = job->next) {
+        if (!job->bg)
+            continue;
+        printf("[%d] %-8s", job->id, job->queued ? "queued" : "running");
+        for (int i = 0; i < job->cmd->num_cmds; i++) {
+            if (i > 0)
+                printf(" |");
+            for (char** a = job->cmd->cmds[i].args; *a; a++)
+                printf(" %s", *a);
+        }
+        if (job->on_done == retry_done) {
+            Retry* r = (Retry*)job->done_ctx;
+            printf("  (try %d/%d)", r->attempt, r->tries);
+        }
+        printf("\n");
+    }
+
+    // the retries waiting out their backoff have no job right now
+    for (Retry* r = retries; r; r = r->next) {
+        if (r->job == 0)
+            printf("[r%d] backoff   %s  (try %d/%d next)\n", r->id, r->line, r->attempt + 1, r->tries);
+    }
+    return 1;
+}
+
+/*
+ * pool            show the pool
+ * pool N          run at most N background jobs at a time
+ * pool auto [P]   let the limit follow the load, keeping the cpu,
+ *                 memory and io stall time under P% (10 by default)
+ * pool off        no limit
+ * */
+
+int sh_pool(Command* cmd)
+{
+    char* arg = cmd->args[1];
+
+    if (arg == NULL) {
+        if (pool_mode == POOL_OFF)
+            printf("pool: off");
+        else if (pool_mode == POOL_FIXED)
+            printf("pool: fixed, limit %d", pool_limit);
+        else
+            printf("pool: auto, target %.1f%%, limit %d, stall cpu %.1f%% memory %.1f%% io %.1f%%",
+                   pool_target, pool_limit, psi_pct[0], psi_pct[1], psi_pct[2]);
+        printf(", %d running, %d queued\n", pool_running, pool_queued);
+        return 1;
+    }
+
+    if (pool_timer) {
+        ev_timer_cancel(pool_timer);
+        pool_timer = 0;
+    }
+
+    if (strcmp(arg, "off") == 0) {
+        pool_mode = POOL_OFF;
+    } else if (strcmp(arg, "auto") == 0) {
+        pool_target = cmd->args[2] ? atof(cmd->args[2]) : 10.0;
+        if (pool_target <= 0 || pool_target >= 100) {
+            fprintf(stderr, "nsh: pool: bad target %s\n", cmd->args[2]);
+            pool_mode = POOL_OFF;
+            return 1;
+        }
+
+        /* the cgroup's own pressure files if we have them
+         * (cgroup v2), otherwise the system wide ones */
+        char* res[3] = { "cpu", "memory", "io" };
+        char cg[4200] = "";
+        FILE* f = fopen("/proc/self/cgroup", "re");
+        if (f) {
+            char line[4096];
+            while (fgets(line, sizeof(line), f)) {
+                if (strncmp(line, "0::", 3) == 0) {
+                    line[strcspn(line, "\n")] = '\0';
+                    snprintf(cg, sizeof(cg), "/sys/fs/cgroup%s", line + 3);
+                }
+            }
+            fclose(f);
+        }
+        for (int i = 0; i < 3; i++) {
+            char path[4300];
+            unsigned long long total;
+            free(psi_path[i]);
+            snprintf(path, sizeof(path), "%s/%s.pressure", cg, res[i]);
+            if (cg[0] == '\0' || psi_read(path, &total) == -1)
+                snprintf(path, sizeof(path), "/proc/pressure/%s", res[i]);
+            psi_path[i] = strdup(path);
+        }
+        if (psi_read(psi_path[0], &psi_total[0]) == -1) {
+            fprintf(stderr, "nsh: pool: no pressure stall information on this system\n");
+            pool_mode = POOL_OFF;
+            return 1;
+        }
+
+        if (pool_mode == POOL_OFF)
+            pool_limit = sysconf(_SC_NPROCESSORS_ONLN);
+        pool_mode = POOL_AUTO;
+        psi_t = 0;
+        psi_sample();
+        pool_timer = ev_timer(1000000000LL, pool_tick, NULL);
+    } else if (atoi(arg) > 0) {
+        pool_mode = POOL_FIXED;
+        pool_limit = atoi(arg);
+    } else {
+        fprintf(stderr, "nsh: pool: expected N, auto [target%%] or off\n");
+        return 1;
+    }
+
+    pool_dispatch();
+    return 1;
+}
+
+/* start queued jobs, oldest first, while the pool has room */
+
+void pool_dispatch(void)
+{
+    /* a job that fails right away dispatches again from inside
+     * execute_cmd(); the loop here takes care of that instead */
+    static int dispatching;
+    if (dispatching)
+        return;
+    dispatching = 1;
+
+    while (pool_queued > 0 && (pool_mode == POOL_OFF || pool_running < pool_limit)) {
+        Job* oldest = NULL;
+        for (Job* job = jobs; job; job = job->next) {
+            if (job->queued && (!oldest || job->id < oldest->id))
+                oldest = job;
+        }
+        oldest->queued = 0;
+        pool_queued--;
+        execute_cmd(oldest);
+    }
+    dispatching = 0;
+}
+
+/*
+ * the controller: additive increase, multiplicative decrease.
+ * while the worst of the three stall percentages is under the
+ * target and there is work waiting, allow one more job; once
+ * it is over, take back a quarter of the limit
+ * */
+
+void pool_tick(void* ctx)
+{
+    (void)ctx;
+    psi_sample();
+
+    double worst = psi_pct[0];
+    for (int i = 1; i < 3; i++) {
+        if (psi_pct[i] > worst)
+            worst = psi_pct[i];
+    }
+
+    if (worst > pool_target) {
+        int cut = pool_limit / 4;
+        pool_limit -= cut > 0 ? cut : 1;
+        if (pool_limit < 1)
+            pool_limit = 1;
+    } else if (pool_queued > 0 && pool_running >= pool_limit) {
+        pool_limit++;
+    }
+
+    pool_dispatch();
+    pool_timer = ev_timer(1000000000LL, pool_tick, NULL);
+}
+
+/* the "some" total from a pressure file, in microseconds */
+
+int psi_read(char* path, unsigned long long* total)
+{
+    char buf[256];
+    int pfd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pfd == -1)
+        return -1;
+    ssize_t n = read(pfd, buf, sizeof(buf) - 1);
+    close(pfd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+
+    char* t = strstr(buf, "total=");
+    if (strncmp(buf, "some", 4) != 0 || t == NULL)
+        return -1;
+    *total = strtoull(t + 6, NULL, 10);
+    return 0;
+}
+
+/* the share of time since the last sample that something was
+ * stalled on each resource, computed from the totals rather
+ * than avg10 so that the controller reacts within a tick */
+
+void psi_sample(void)
+{
+    long long now = now_ns();
+    for (int i = 0; i < 3; i++) {
+        unsigned long long total;
+        if (psi_read(psi_path[i], &total) == -1)
+            continue;
+        if (psi_t > 0 && now > psi_t)
+            psi_pct[i] = 100.0 * (total - psi_total[i]) * 1000 / (now - psi_t);
+        psi_total[i] = total;
+    }
+    psi_t = now;
+}
+
+/*
+ * prio [-n NICE] [-s other|batch|idle] [-c idle|be[:N]|rt[:N]] [-g CGROUP] CMD...
+ *     runs the pipeline with that nice value, scheduling policy,
+ *     io priority class (and level, 0-7) and in that cgroup (v2
+ *     directory, e.g. /sys/fs/cgroup/batch)
+ * prio -b [options]
+ *     sets the defaults for jobs started with &, used when the
+ *     job doesn't have a prio of its own. -b alone clears them
+ * prio
+ *     shows the defaults
+ *
+ * the prefix is taken off the first command of the pipeline,
+ * what is left of it is the command to run
+ * */
+
+int prio_parse(FullCommand* cmd)
+{
+    char** args = cmd->cmds->args;
+    Prio p;
+    int defaults = 0;
+    int i = 1;
+
+    memset(&p, 0, sizeof(p));
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        char* opt = args[i];
+        char* val = args[i+1];
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-b") == 0) {
+            defaults = 1;
+            continue;
+        }
+        if (val == NULL) {
+            fprintf(stderr, "nsh: prio: %s needs a value\n", opt);
+            return -1;
+        }
+        i++;
+
+        if (strcmp(opt, "-n") == 0) {
+            char* end;
+            long n = strtol(val, &end, 10);
+            if (end == val || *end != '\0' || n < -20 || n > 19) {
+                fprintf(stderr, "nsh: prio: nice %s is not -20-19\n", val);
+                return -1;
             }
+            p.set |= SET_NICE;
+            p.nice = n;
+        } else if (strcmp(opt, "-s") == 0) {
+            p.set |= SET_POLICY;
+            if (strcmp(val, "other") == 0)
+                p.policy = SCHED_OTHER;
+            else if (strcmp(val, "batch") == 0)
+                p.policy = SCHED_BATCH;
+            else if (strcmp(val, "idle") == 0)
+                p.policy = SCHED_IDLE;
+            else {
+                fprintf(stderr, "nsh: prio: unknown policy %s\n", val);
+                return -1;
+            }
+        } else if (strcmp(opt, "-g") == 0) {
+            p.set |= SET_CGROUP;
+            p.cgroup = val;
+        } else if (strcmp(opt, "-c") == 0) {
+            p.set |= SET_IOPRIO;
+            p.iolevel = 4;
+            size_t len = strcspn(val, ":");
+            if (len == 2 && strncmp(val, "rt", 2) == 0)
+                p.ioclass = 1;
+            else if (len == 2 && strncmp(val, "be", 2) == 0)
+                p.ioclass = 2;
+            else if (strcmp(val, "idle") == 0)
+                p.ioclass = 3;
+            else {
+                fprintf(stderr, "nsh: prio: unknown io class %s\n", val);
+                return -1;
+            }
+            if (p.ioclass == 3) {
+                p.iolevel = 0;
+            } else if (val[2] == ':') {
+                // one digit, 0-7, and nothing after it
+                if (val[3] < '0' || val[3] > '7' || val[4] != '\0') {
+                    fprintf(stderr, "nsh: prio: io level %s is not 0-7\n", val + 3);
+                    return -1;
+                }
+                p.iolevel = val[3] - '0';
+            }
+        } else {
+            fprintf(stderr, "nsh: prio: unknown option %s\n", opt);
+            return -1;
         }
     }
 
-    /* restore stdin and stdout */
-    dup2(tin, 0);
-    dup2(tout, 1);
-    close(tin);
-    close(tout);
+    // shift the prefix out of the command
+    int n = 0;
+    while (args[i] != NULL)
+        args[n++] = args[i++];
+    args[n] = NULL;
+    cmd->cmds->num_args = n;
+
+    if (defaults) {
+        // the defaults outlive this line
+        free(bg_prio.cgroup);
+        bg_prio = p;
+        if (p.set & SET_CGROUP)
+            bg_prio.cgroup = strdup(p.cgroup);
+    } else if (n == 0) {
+        prio_print("background jobs", &bg_prio);
+    }
+    cmd->prio = p;
+    return 0;
+}
+
+/* runs in the child, right before exec. failing to
+ * lower our own priority is not worth failing over */
+
+void prio_apply(Prio* p)
+{
+    if (p->set & SET_POLICY) {
+        struct sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        if (sched_setscheduler(0, p->policy, &sp) == -1)
+            perror("nsh: prio");
+    }
+    if (p->set & SET_NICE) {
+        if (setpriority(PRIO_PROCESS, 0, p->nice) == -1)
+            perror("nsh: prio");
+    }
+    if (p->set & SET_IOPRIO) {
+        int ioprio = p->ioclass << IOPRIO_CLASS_SHIFT | p->iolevel;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1)
+            perror("nsh: prio");
+    }
+}
+
+void prio_print(char* what, Prio* p)
+{
+    char* policies[] = { "other", "fifo", "rr", "batch", "", "idle" };
+    char* classes[] = { "none", "rt", "be", "idle" };
+
+    printf("%s:", what);
+    if (!p->set)
+        printf(" inherited");
+    if (p->set & SET_NICE)
+        printf(" nice %d", p->nice);
+    if (p->set & SET_POLICY)
+        printf(" policy %s", policies[p->policy]);
+    if (p->set & SET_IOPRIO)
+        printf(" io %s:%d", classes[p->ioclass], p->iolevel);
+    if (p->set & SET_CGROUP)
+        printf(" cgroup %s", p->cgroup);
+    printf("\n");
+    fflush(stdout);
+}
+
+/* export NAME=VALUE...    with no arguments, prints the environment */
 
-    if (!bg_flag) {
-        waitpid(pid, &status, 0);
+int sh_export(Command* cmd)
+{
+    if (cmd->args[1] == NULL) {
+        for (char** v = environ; *v; v++)
+            printf("%s\n", *v);
+        return 1;
+    }
+
+    for (int i = 1; cmd->args[i] != NULL; i++) {
+        char* eq = strchr(cmd->args[i], '=');
+        if (eq == NULL || eq == cmd->args[i]) {
+            fprintf(stderr, "nsh: export: expected NAME=VALUE, got %s\n", cmd->args[i]);
+            continue;
+        }
+        *eq = '\0';
+        setenv(cmd->args[i], eq + 1, 1);
+        if (strcmp(cmd->args[i], "PATH") == 0)
+            path_flush();
+        *eq = '=';
+        env_gen++;
     }
+    return 1;
+}
 
+int sh_unset(Command* cmd)
+{
+    for (int i = 1; cmd->args[i] != NULL; i++) {
+        unsetenv(cmd->args[i]);
+        if (strcmp(cmd->args[i], "PATH") == 0)
+            path_flush();
+        env_gen++;
+    }
     return 1;
 }
 
+/* hash shows the path cache, hash -r empties it */
+
+int sh_hash(Command* cmd)
+{
+    if (cmd->args[1] != NULL && strcmp(cmd->args[1], "-r") == 0) {
+        path_flush();
+        return 1;
+    }
+
+    printf("%llu hits, %llu misses\n", path_hits, path_misses);
+    for (unsigned int i = 0; i < path_cap; i++) {
+        if (path_tab[i].name)
+            printf("%-16s %s\n", path_tab[i].name, path_tab[i].path);
+    }
+    return 1;
+}
+
+/*
+ * the environment handed to children. execvp() would take
+ * environ as it is, but we'd rather pay for a copy once per
+ * change than have it walked and rebuilt per spawn: the
+ * pointers and the strings go into a single allocation
+ * that is reused until export or unset touch anything
+ * */
+
+char** env_snapshot(void)
+{
+    if (envp != NULL && envp_gen == env_gen)
+        return envp;
+
+    size_t n = 0;
+    size_t bytes = 0;
+    for (char** v = environ; *v; v++) {
+        n++;
+        bytes += strlen(*v) + 1;
+    }
+
+    free(envp);
+    envp = (char**)malloc((n + 1) * sizeof(char*) + bytes);
+    if (!envp) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char* p = (char*)(envp + n + 1);
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(environ[i]) + 1;
+        memcpy(p, environ[i], len);
+        envp[i] = p;
+        p += len;
+    }
+    envp[n] = NULL;
+    envp_gen = env_gen;
+    return envp;
+}
+
+/*
+ * path_lookup() finds the file a command name runs, searching
+ * PATH once per name and remembering the answer, so that the
+ * child doesn't go through a failing execve() for every
+ * directory in front of the right one. names with a slash are
+ * used as they are, names that aren't found aren't cached.
+ * same table layout as the stats one
+ * */
+
+char* path_lookup(char* name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    unsigned int hash = hash_str(name);
+    if (path_cap > 0) {
+        unsigned int j = hash & (path_cap - 1);
+        while (path_tab[j].name) {
+            if (path_tab[j].hash == hash && strcmp(path_tab[j].name, name) == 0) {
+                path_hits++;
+                return path_tab[j].path;
+            }
+            j = (j + 1) & (path_cap - 1);
+        }
+    }
+    path_misses++;
+
+    char* dirs = getenv("PATH");
+    char* found = NULL;
+    size_t nlen = strlen(name);
+    if (dirs == NULL)
+        dirs = "/bin:/usr/bin";
+    while (found == NULL) {
+        size_t dlen = strcspn(dirs, ":");
+        char* full = (char*)malloc(dlen + nlen + 3);
+        struct stat sb;
+
+        // an empty entry is the current directory
+        if (dlen == 0)
+            sprintf(full, "./%s", name);
+        else
+            sprintf(full, "%.*s/%s", (int)dlen, dirs, name);
+        if (stat(full, &sb) == 0 && S_ISREG(sb.st_mode) && access(full, X_OK) == 0)
+            found = full;
+        else
+            free(full);
+
+        if (dirs[dlen] == '\0')
+            break;
+        dirs += dlen + 1;
+    }
+    if (found == NULL)
+        return NULL;
+
+    if (4 * (path_len + 1) > 3 * path_cap) {
+        unsigned int ncap = path_cap ? path_cap * 2 : 64;
+        PathSlot* ntab = (PathSlot*)calloc(ncap, sizeof(PathSlot));
+        if (!ntab) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int i = 0; i < path_cap; i++) {
+            if (!path_tab[i].name)
+                continue;
+            unsigned int j = path_tab[i].hash & (ncap - 1);
+            while (ntab[j].name)
+                j = (j + 1) & (ncap - 1);
+            ntab[j] = path_tab[i];
+        }
+        free(path_tab);
+        path_tab = ntab;
+        path_cap = ncap;
+    }
+
+    unsigned int j = hash & (path_cap - 1);
+    while (path_tab[j].name)
+        j = (j + 1) & (path_cap - 1);
+    path_tab[j].hash = hash;
+    path_tab[j].name = strdup(name);
+    path_tab[j].path = found;
+    path_len++;
+    return found;
+}
+
+void path_flush(void)
+{
+    for (unsigned int i = 0; i < path_cap; i++) {
+        free(path_tab[i].name);
+        free(path_tab[i].path);
+    }
+    free(path_tab);
+    path_tab = NULL;
+    path_cap = path_len = 0;
+}
+
+/*
+ * watch-run [-d MS] PATH... -- PIPELINE
+ *     runs the pipeline, and again whenever something under one of
+ *     the paths changes. a burst of events within MS milliseconds
+ *     (200 by default) counts as one change. if a change comes in
+ *     while the pipeline is still running, that run is killed and a
+ *     new one started once it is gone
+ * watch-run
+ *     lists the watches
+ * watch-run -k ID
+ *     stops one
+ * */
+
+int sh_watch_run(char* line)
+{
+    char* rest = strstr(line, " -- ");
+    char* tok;
+
+    if (rest == NULL) {
+        char* arg = strtok(line, " ");
+        if (arg != NULL && strcmp(arg, "-k") == 0) {
+            char* id_arg = strtok(NULL, " ");
+            int id = id_arg ? atoi(id_arg) : 0;
+            for (Watch* w = watches; w; w = w->next) {
+                if (w->id == id) {
+                    watch_free(w);
+                    return 1;
+                }
+            }
+            fprintf(stderr, "nsh: watch-run: no watch %d\n", id);
+        } else if (arg != NULL) {
+            fprintf(stderr, "nsh: watch-run usage: watch-run [-d ms] path... -- pipeline\n");
+        } else {
+            for (Watch* w = watches; w; w = w->next) {
+                printf("[%d] %s%s:", w->id, w->job ? "running " : "", w->line);
+                for (int i = 0; i < w->num_paths; i++)
+                    printf(" %s", w->paths[i]);
+                printf("\n");
+            }
+            fflush(stdout);
+        }
+        return 1;
+    }
+
+    if (ino_fd == -1) {
+        ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ino_fd == -1) {
+            perror("nsh: watch-run");
+            return 1;
+        }
+        ev_add(ino_fd, EPOLLIN, on_inotify, NULL);
+    }
+
+    Watch* w = (Watch*)calloc(1, sizeof(Watch));
+    w->line = strdup(rest + 4);
+    w->debounce = 200000000LL;
+    *rest = '\0';
+
+    for (tok = strtok(line, " "); tok != NULL; tok = strtok(NULL, " ")) {
+        if (strcmp(tok, "-d") == 0 && (tok = strtok(NULL, " ")) != NULL) {
+            w->debounce = atoll(tok) * 1000000LL;
+            continue;
+        }
+        w->paths = (char**)realloc(w->paths, (w->num_paths + 1) * sizeof(char*));
+        w->wds = (int*)realloc(w->wds, (w->num_paths + 1) * sizeof(int));
+        w->paths[w->num_paths] = strdup(tok);
+        w->wds[w->num_paths] = -1;
+        w->num_paths++;
+    }
+
+    // nothing to watch, or nothing to run: it would only keep the shell alive
+    if (w->num_paths == 0 || w->line[strspn(w->line, " ")] == '\0') {
+        fprintf(stderr, "nsh: watch-run usage: watch-run [-d ms] path... -- pipeline\n");
+        for (int i = 0; i < w->num_paths; i++)
+            free(w->paths[i]);
+        free(w->paths);
+        free(w->wds);
+        free(w->line);
+        free(w);
+        return 1;
+    }
+
+    w->id = ++watch_ids;
+    w->next = watches;
+    watches = w;
+    keepalive++;
+
+    watch_add_paths(w);
+    watch_start(w);
+    return 1;
+}
+
+/* (re)adds the inotify watches. an editor that saves by
+ * renaming over the file leaves us watching the old inode,
+ * so this happens again after every change, and the old
+ * inode's wd goes once nothing else is on it */
+
+void watch_add_paths(Watch* w)
+{
+    unsigned int mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE
+                        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    for (int i = 0; i < w->num_paths; i++) {
+        int old = w->wds[i];
+        w->wds[i] = inotify_add_watch(ino_fd, w->paths[i], mask);
+        if (w->wds[i] == -1)
+            fprintf(stderr, "nsh: watch-run: %s: %s\n", w->paths[i], strerror(errno));
+        if (old == -1 || old == w->wds[i])
+            continue;
+        int shared = 0;
+        for (Watch* o = watches; o && !shared; o = o->next) {
+            for (int k = 0; k < o->num_paths; k++)
+                shared |= o->wds[k] == old;
+        }
+        if (!shared)
+            inotify_rm_watch(ino_fd, old);
+    }
+}
+
+void watch_start(Watch* w)
+{
+    run_pipeline(w->line, 1, watch_done, w, &w->job);
+    if (job_find(w->job) == NULL)
+        w->job = 0;
+}
+
+void on_inotify(int fd, unsigned int events, void* ctx)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    (void)events;
+    (void)ctx;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            for (Watch* w = watches; w; w = w->next) {
+                for (int i = 0; i < w->num_paths; i++) {
+                    if (w->wds[i] != ev->wd)
+                        continue;
+                    // debounce: only the last event of a burst counts
+                    if (w->timer)
+                        ev_timer_cancel(w->timer);
+                    w->timer = ev_timer(w->debounce, watch_fire, w);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void watch_fire(void* ctx)
+{
+    Watch* w = (Watch*)ctx;
+    Job* job = job_find(w->job);
+
+    w->timer = 0;
+    watch_add_paths(w);
+    if (job != NULL) {
+        w->again = 1;
+        job_kill(job, SIGTERM);
+    } else {
+        watch_start(w);
+    }
+}
+
+void watch_done(Job* job, void* ctx)
+{
+    Watch* w = (Watch*)ctx;
+    (void)job;
+
+    w->job = 0;
+    if (w->again) {
+        w->again = 0;
+        watch_start(w);
+    }
+}
+
+void watch_free(Watch* w)
+{
+    for (Watch** p = &watches; *p; p = &(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+
+    Job* job = job_find(w->job);
+    if (job != NULL) {
+        job->on_done = NULL;
+        job_kill(job, SIGTERM);
+    }
+    if (w->timer)
+        ev_timer_cancel(w->timer);
+
+    /* the same path watched twice shares a wd, it
+     * can only go once nobody else is using it */
+    for (int i = 0; i < w->num_paths; i++) {
+        int shared = 0;
+        for (Watch* o = watches; o && !shared; o = o->next) {
+            for (int k = 0; k < o->num_paths; k++)
+                shared |= o->wds[k] == w->wds[i];
+        }
+        if (!shared && w->wds[i] != -1)
+            inotify_rm_watch(ino_fd, w->wds[i]);
+        free(w->paths[i]);
+    }
+    free(w->paths);
+    free(w->wds);
+    free(w->line);
+    free(w);
+    keepalive--;
+}
+
+/* 1500ms, 30s, 5m, 2h, 1d, or plain seconds. -1 if it is none of those */
+
+long long parse_duration(char* s)
+{
+    char* end;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0)
+        return -1;
+    if (strcmp(end, "ms") == 0)
+        return v * 1e6;
+    if (*end == '\0' || strcmp(end, "s") == 0)
+        return v * 1e9;
+    if (strcmp(end, "m") == 0)
+        return v * 60e9;
+    if (strcmp(end, "h") == 0)
+        return v * 3600e9;
+    if (strcmp(end, "d") == 0)
+        return v * 86400e9;
+    return -1;
+}
+
+/*
+ * every [-o skip|queue|kill] INTERVAL -- PIPELINE
+ *     runs the pipeline every INTERVAL (see parse_duration), on a
+ *     fixed beat that doesn't drift with how long the runs take.
+ *     when a run is due and the last one is still going, -o says
+ *     what happens: skip it (the default), queue it to start once
+ *     the last one is done, or kill the last one and start over
+ * at TIME -- PIPELINE
+ *     runs it once, at HH:MM[:SS] (the next one to come) or in
+ *     +INTERVAL
+ * every, at
+ *     list what is scheduled, -k ID cancels
+ * */
+
+int sh_every(char* line)
+{
+    char* rest = sched_rest(line);
+    int overlap = OVERLAP_SKIP;
+    long long period = -1;
+
+    if (rest == NULL)
+        return sched_admin(line, "every");
+
+    // anything we don't take is an error right away, a later token can't undo it
+    int bad = 0;
+    for (char* tok = strtok(line, " "); tok != NULL && !bad; tok = strtok(NULL, " ")) {
+        if (strcmp(tok, "-o") == 0) {
+            tok = strtok(NULL, " ");
+            if (tok != NULL && strcmp(tok, "skip") == 0)
+                overlap = OVERLAP_SKIP;
+            else if (tok != NULL && strcmp(tok, "queue") == 0)
+                overlap = OVERLAP_QUEUE;
+            else if (tok != NULL && strcmp(tok, "kill") == 0)
+                overlap = OVERLAP_KILL;
+            else
+                bad = 1;
+        } else if (period == -1) {
+            period = parse_duration(tok);
+            bad = period <= 0;
+        } else {
+            bad = 1;
+        }
+    }
+    if (bad || period <= 0 || *rest == '\0') {
+        fprintf(stderr, "nsh: every usage: every [-o skip|queue|kill] interval -- pipeline\n");
+        return 1;
+    }
+
+    Sched* s = sched_new(rest, period);
+    s->period = period;
+    s->overlap = overlap;
+    return 1;
+}
+
+int sh_at(char* line)
+{
+    char* rest = sched_rest(line);
+    char* when;
+    long long delay = -1;
+
+    if (rest == NULL)
+        return sched_admin(line, "at");
+
+    when = strtok(line, " ");
+    if (when != NULL && when[0] == '+') {
+        delay = parse_duration(when + 1);
+    } else if (when != NULL) {
+        int h, m, sec = 0, len = 0;
+        /* checked here, mktime() would take 25:99 for a time
+         * tomorrow. len ends up past the last number read */
+        if (sscanf(when, "%d:%d%n:%d%n", &h, &m, &len, &sec, &len) >= 2 && when[len] == '\0'
+            && h >= 0 && h <= 23 && m >= 0 && m <= 59 && sec >= 0 && sec <= 59) {
+            time_t now = time(NULL);
+            struct tm tm;
+            localtime_r(&now, &tm);
+            tm.tm_hour = h;
+            tm.tm_min = m;
+            tm.tm_sec = sec;
+            tm.tm_isdst = -1;
+            time_t t = mktime(&tm);
+            if (t <= now) {
+                tm.tm_mday++;
+                t = mktime(&tm);
+            }
+            delay = (long long)(t - now) * 1000000000LL;
+        }
+    }
+    if (strtok(NULL, " ") != NULL || *rest == '\0')
+        delay = -1;
+    if (delay < 0) {
+        fprintf(stderr, "nsh: at usage: at HH:MM[:SS]|+interval -- pipeline\n");
+        return 1;
+    }
+
+    sched_new(rest, delay);
+    return 1;
+}
+
+/* ends line at its " -- " (or the " --" it ends with) and returns
+ * the pipeline after it, blanks skipped. NULL if there is no -- */
+
+char* sched_rest(char* line)
+{
+    char* rest = strstr(line, " -- ");
+    size_t len = strlen(line);
+
+    if (rest == NULL && len >= 3 && strcmp(line + len - 3, " --") == 0)
+        rest = line + len - 3;
+    if (rest == NULL)
+        return NULL;
+    *rest = '\0';
+    rest += 3;
+    return rest + strspn(rest, " \t");
+}
+
+/* every/at without a pipeline: list, or -k ID */
+
+int sched_admin(char* line, char* name)
+{
+    char* arg = strtok(line, " ");
+
+    if (arg == NULL) {
+        long long now = now_ns();
+        char* policies[] = { "skip", "queue", "kill" };
+        for (Sched* s = scheds; s; s = s->next) {
+            char due[16];
+            fmt_us(due, sizeof(due), s->due > now ? (s->due - now) / 1000 : 0);
+            if (s->period) {
+                char every[16];
+                fmt_us(every, sizeof(every), s->period / 1000);
+                printf("[%d] every %s (%s), next in %s%s: %s\n", s->id, every,
+                       policies[s->overlap], due, s->job ? ", running" : "", s->line);
+            } else {
+                printf("[%d] at, in %s: %s\n", s->id, due, s->line);
+            }
+        }
+        fflush(stdout);
+        return 1;
+    }
+
+    if (strcmp(arg, "-k") == 0 && (arg = strtok(NULL, " ")) != NULL) {
+        for (Sched* s = scheds; s; s = s->next) {
+            if (s->id == atoi(arg)) {
+                sched_free(s);
+                return 1;
+            }
+        }
+        fprintf(stderr, "nsh: %s: nothing scheduled as %s\n", name, arg);
+        return 1;
+    }
+
+    fprintf(stderr, "nsh: %s: expected a pipeline after --, or -k ID\n", name);
+    return 1;
+}
+
+Sched* sched_new(char* line, long long delay)
+{
+    Sched* s = (Sched*)calloc(1, sizeof(Sched));
+    if (!s) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    s->id = ++sched_ids;
+    s->line = strdup(line);
+    s->due = now_ns() + delay;
+    s->timer = ev_timer(delay, sched_fire, s);
+    s->next = scheds;
+    scheds = s;
+    keepalive++;
+    return s;
+}
+
+void sched_fire(void* ctx)
+{
+    Sched* s = (Sched*)ctx;
+    Job* job = job_find(s->job);
+    s->timer = 0;
+
+    if (s->period == 0) {
+        // at: the run doesn't need us, nobody is left to wait for it
+        run_pipeline(s->line, 1, NULL, NULL, NULL);
+        sched_free(s);
+        return;
+    }
+
+    // the next beat, skipping any we were too late for
+    long long now = now_ns();
+    while (s->due <= now)
+        s->due += s->period;
+    s->timer = ev_timer(s->due - now, sched_fire, s);
+
+    if (job == NULL) {
+        sched_start(s);
+    } else if (s->overlap == OVERLAP_QUEUE) {
+        s->pending++;
+    } else if (s->overlap == OVERLAP_KILL) {
+        s->pending = 1;
+        job_kill(job, SIGTERM);
+    }
+}
+
+void sched_start(Sched* s)
+{
+    run_pipeline(s->line, 1, sched_done, s, &s->job);
+    if (job_find(s->job) == NULL)
+        s->job = 0;
+}
+
+void sched_done(Job* job, void* ctx)
+{
+    Sched* s = (Sched*)ctx;
+    (void)job;
+
+    s->job = 0;
+    if (s->pending > 0) {
+        s->pending--;
+        sched_start(s);
+    }
+}
+
+void sched_free(Sched* s)
+{
+    for (Sched** p = &scheds; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+
+    // a run in flight is left to finish
+    Job* job = job_find(s->job);
+    if (job != NULL)
+        job->on_done = NULL;
+    if (s->timer)
+        ev_timer_cancel(s->timer);
+    free(s->line);
+    free(s);
+    keepalive--;
+}
+
+/*
+ * retry N [backoff=BASE[:MAX]] pipeline
+ *     runs the pipeline up to N times until it exits 0. the wait
+ *     between tries starts at BASE (1s by default) and doubles up
+ *     to MAX (5m), it is a timer in here rather than a sleep in a
+ *     child. a foreground retry holds the prompt until it is over
+ * retry -k ID
+ *     stops retrying, a try already running is left alone
+ * */
+
+int sh_retry(char* line)
+{
+    char* p = line;
+    char* end;
+    long long backoff = 1000000000LL;
+    long long max = 300000000000LL;
+
+    while (*p == ' ')
+        p++;
+
+    if (strncmp(p, "-k ", 3) == 0) {
+        Retry* r = retry_find(atoi(p + 3));
+        if (r == NULL)
+            fprintf(stderr, "nsh: retry: no retry %s\n", p + 3);
+        else
+            retry_free(r);
+        return 1;
+    }
+
+    int tries = strtol(p, &end, 10);
+    if (end == p || tries < 1 || (*end != ' ' && *end != '\0')) {
+        fprintf(stderr, "nsh: retry usage: retry N [backoff=base[:max]] pipeline\n");
+        return 1;
+    }
+    p = end;
+    while (*p == ' ')
+        p++;
+
+    if (strncmp(p, "backoff=", 8) == 0) {
+        char* arg = p + 8;
+        p = strchr(arg, ' ');
+        if (p != NULL)
+            *p++ = '\0';
+        else
+            p = arg + strlen(arg);
+        char* colon = strchr(arg, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            max = parse_duration(colon + 1);
+        }
+        backoff = parse_duration(arg);
+        if (backoff < 0 || max < 0) {
+            fprintf(stderr, "nsh: retry: bad backoff\n");
+            return 1;
+        }
+    }
+
+    Retry* r = (Retry*)calloc(1, sizeof(Retry));
+    if (!r) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    r->id = ++retry_ids;
+    r->line = strdup(p);
+    for (size_t n = strlen(r->line); n > 0 && r->line[n-1] == ' '; n--)
+        r->line[n-1] = '\0';
+    r->bg = bg;
+    r->tries = tries;
+    r->backoff = backoff;
+    r->max = max;
+    r->next = retries;
+    retries = r;
+    keepalive++;
+
+    int id = r->id;
+    retry_start(r);
+    if (!bg) {
+        while (retry_find(id) != NULL)
+            ev_run(1);
+    }
+    return 1;
+}
+
+Retry* retry_find(int id)
+{
+    for (Retry* r = retries; r; r = r->next) {
+        if (r->id == id)
+            return r;
+    }
+    return NULL;
+}
+
+void retry_start(void* ctx)
+{
+    Retry* r = (Retry*)ctx;
+    int id = r->id;
+
+    r->timer = 0;
+    r->attempt++;
+    run_pipeline(r->line, r->bg, retry_done, r, &r->job);
+
+    // a foreground try is over already and r may be gone with it.
+    // no job and no timer means a builtin ran, nothing to retry
+    r = retry_find(id);
+    if (r != NULL && r->job == 0 && r->timer == 0)
+        retry_free(r);
+}
+
+void retry_done(Job* job, void* ctx)
+{
+    Retry* r = (Retry*)ctx;
+
+    r->job = 0;
+    if (job->status == 0) {
+        retry_free(r);
+        return;
+    }
+    if (r->attempt >= r->tries) {
+        fprintf(stderr, "nsh: retry: gave up after %d tries: %s\n", r->tries, r->line);
+        retry_free(r);
+        return;
+    }
+
+    long long wait = r->backoff;
+    for (int i = 1; i < r->attempt && wait < r->max; i++)
+        wait *= 2;
+    if (wait > r->max)
+        wait = r->max;
+    r->timer = ev_timer(wait, retry_start, r);
+}
+
+void retry_free(Retry* r)
+{
+    for (Retry** p = &retries; *p; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+
+    Job* job = job_find(r->job);
+    if (job != NULL)
+        job->on_done = NULL;
+    if (r->timer)
+        ev_timer_cancel(r->timer);
+    free(r->line);
+    free(r);
+    keepalive--;
+}
+
+/*
+ * memstats prints what the shell holds on to, by what it is for.
+ * the sizes are what we asked malloc for (the usable size where
+ * we have the pointer), the malloc line is malloc's own view
+ * with its overhead and free lists. 'memstats trim' drops the
+ * caches and the buffers that are only big because they once
+ * had to be, and hands free memory back with malloc_trim()
+ * */
+
+int sh_memstats(Command* cmd)
+{
+    if (cmd->args[1] != NULL && strcmp(cmd->args[1], "trim") == 0) {
+        long before = rss_kb();
+
+        path_flush();
+        free(envp);
+        envp = NULL;
+        if (jlog_fd != -1)
+            jlog_flush();
+        if (jlog_len == 0) {
+            // not if the writer was busy and it is still waiting here
+            free(jlog_buf);
+            jlog_buf = NULL;
+            jlog_cap = 0;
+        }
+        if (in_cap > 65536 && in_len - in_off < 4096) {
+            memmove(inbuf, inbuf + in_off, in_len - in_off);
+            in_len -= in_off;
+            in_off = 0;
+            // shrinking can fail too, the old buffer does then
+            char* p = (char*)realloc(inbuf, 65536);
+            if (p != NULL) {
+                inbuf = p;
+                in_cap = 65536;
+            }
+        }
+        malloc_trim(0);
+
+        printf("rss %ld kB -> %ld kB\n", before, rss_kb());
+        fflush(stdout);
+        return 1;
+    }
+    if (cmd->args[1] != NULL) {
+        fprintf(stderr, "nsh: memstats usage: memstats [trim]\n");
+        return 1;
+    }
+
+    size_t jobs_bytes = cap_procs * sizeof(Proc);
+    for (Job* job = jobs; job; job = job->next)
+        jobs_bytes += sizeof(Job) + job->cmd->num_cmds * sizeof(StageRun);
+
+    size_t stat_bytes = stat_cap * sizeof(StatSlot);
+    for (unsigned int i = 0; i < stat_cap; i++) {
+        if (stat_tab[i].st)
+            stat_bytes += sizeof(CmdStats) + malloc_usable_size(stat_tab[i].st->name);
+    }
+
+    size_t path_bytes = path_cap * sizeof(PathSlot);
+    for (unsigned int i = 0; i < path_cap; i++) {
+        path_bytes += malloc_usable_size(path_tab[i].name);
+        path_bytes += malloc_usable_size(path_tab[i].path);
+    }
+
+    size_t sched_bytes = 0;
+    for (Watch* w = watches; w; w = w->next)
+        sched_bytes += sizeof(Watch) + malloc_usable_size(w->line);
+    for (Sched* s = scheds; s; s = s->next)
+        sched_bytes += sizeof(Sched) + malloc_usable_size(s->line);
+    for (Retry* r = retries; r; r = r->next)
+        sched_bytes += sizeof(Retry) + malloc_usable_size(r->line);
+
+    // the writer thread swaps these under the lock
+    pthread_mutex_lock(&jlog_mu);
+    size_t jlog_out_bytes = jlog_out_cap;
+    size_t jlog_writing = jlog_out_len;
+    pthread_mutex_unlock(&jlog_mu);
+
+    struct mallinfo2 mi = mallinfo2();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("%-16s %10zu  %d live (%d on huge pages), peak %zu\n",
+           "parser arenas", arena_live, arena_count, arena_huge, arena_peak);
+    printf("%-16s %10zu  %d jobs, %d children\n", "job table", jobs_bytes, num_jobs, num_procs);
+    printf("%-16s %10zu  %u commands\n", "stats", stat_bytes, stat_len);
+    printf("%-16s %10zu  %u paths\n", "path cache", path_bytes, path_len);
+    printf("%-16s %10zu\n", "envp snapshot", malloc_usable_size(envp));
+    printf("%-16s %10zu  %zu pending\n", "input buffer", in_cap, in_len - in_off);
+    printf("%-16s %10zu  %zu pending, %zu being written, %llu dropped\n", "json log buffer",
+           jlog_cap + jlog_out_bytes, jlog_len, jlog_writing, jlog_dropped);
+    printf("%-16s %10zu  %d fds, %d timers\n", "event loop",
+           ev_cap * sizeof(EvWatch) + cap_timers * sizeof(Timer), ev_cap, num_timers);
+    printf("%-16s %10zu\n", "watch/every/retry", sched_bytes);
+    printf("%-16s %10zu  in use, %zu free, %zu mmap'd\n", "malloc",
+           mi.uordblks + mi.hblkhd, mi.fordblks, mi.hblkhd);
+    printf("%-16s %10ld  kB, max %ld kB\n", "rss", rss_kb(), ru.ru_maxrss);
+    fflush(stdout);
+    return 1;
+}
+
+/* resident set size from /proc/self/statm, -1 if there is none */
+
+long rss_kb(void)
+{
+    long size, resident;
+    FILE* f = fopen("/proc/self/statm", "re");
+
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+Stage* stage_find(char* name)
+{
+    for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+        if (strcmp(name, stages[s].name) == 0)
+            return &stages[s];
+    }
+    return NULL;
+}
+
+/* -1 if the command doesn't run as a builtin stage, see Stage */
+
+int stage_probe(Command* cmd)
+{
+    Stage* s = stage_find(cmd->args[0]);
+    return s ? s->open(cmd, NULL) : -1;
+}
+
+/*
+ * stage_run() is what the child of a run of builtin stages
+ * does: each one's output is pushed straight into the next
+ * one, so between them there is no pipe, no copy through the
+ * kernel and no context switch. the first one reads fd 0 (or
+ * its files), the last one writes to fd 1. returns the exit
+ * status of the last one, like a pipeline's, or 2 when the
+ * input couldn't be read
+ *
+ * once a stage has had enough (head got its lines), the ones
+ * before it have nothing left to do either: reading stops
+ * and fd 0 is closed right away, so whatever feeds us through
+ * a pipe gets EPIPE instead of running to the end
+ * */
+
+int stage_run(Command* cmds, int n)
+{
+    Filter** fs = (Filter**)calloc(n, sizeof(Filter*));
+    int status = 0;
+
+    for (int k = 0; k < n; k++) {
+        int ret = stage_find(cmds[k].args[0])->open(&cmds[k], &fs[k]);
+        if (ret != 0)
+            return ret;
+    }
+    for (int k = 0; k < n; k++)
+        out_init(&fs[k]->out, 1, k < n - 1 ? fs[k+1] : NULL, 256 << 10);
+
+    int m = stage_split(cmds, fs, n, &status);
+    Filter* f = fs[0];
+    Blocks b;
+    char* p;
+    ssize_t len = 0;
+    int reads = m == 0 && !f->source;
+    if (reads && blk_open(&b, f->files, f->block ? f->block : 1 << 20, f->raw) == -1)
+        return 2;
+    while (reads && (len = blk_next(&b, f->block != 0, &p)) > 0) {
+        int enough = f->push(f, p, len);
+        if (f->block == 0) {
+            // keep up with a slow producer: what is done goes on now
+            for (int k = 0; k < n; k++)
+                out_drain(&fs[k]->out, 0);
+        }
+        for (int k = 0; k < n; k++)
+            enough |= fs[k]->out.done;
+        if (enough) {
+            if (b.fd > 0)
+                close(b.fd);
+            close(0);
+            break;
+        }
+    }
+    if (len < 0)
+        status = 2;
+
+    // in order, each one's last output is pushed into the next one
+    for (int k = m; k < n; k++) {
+        int ret = fs[k]->finish(fs[k]);
+        if (k == n - 1 && status == 0)
+            status = ret;
+    }
+    return status;
+}
+
+/*
+ * the first stages of a run often work on each line by itself
+ * (grep, fields, tr). if their input is a regular file, it is
+ * cut into one range per worker thread, newline-aligned by a
+ * scan back from each cut, and each worker runs a copy of those
+ * stages of its own over its range. their output is collected
+ * and handed on in file order, to the first stage that can't
+ * be split or to fd 1. the file is mapped, and gone through in
+ * rounds of SPLIT_CHUNK per worker so that what is collected
+ * stays bounded.
+ *
+ * returns how many stages it ran, 0 if it didn't take them on.
+ * *status is set when that was all of them
+ * */
+
+int stage_split(Command* cmds, Filter** fs, int n, int* status)
+{
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int m = 0;
+    int fd = 0;
+    struct stat sb;
+
+    while (m < n && fs[m]->split)
+        m++;
+    if (workers > 64)
+        workers = 64;
+    if (m == 0 || workers < 2)
+        return 0;
+
+    char** files = fs[0]->files;
+    if (files && (files[1] != NULL || strcmp(files[0], "-") == 0))
+        return 0;
+    if (files && (fd = open(files[0], O_RDONLY | O_CLOEXEC)) == -1)
+        return 0;   // the usual way has the error message for it
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size < SPLIT_CHUNK) {
+        if (fd != 0)
+            close(fd);
+        return 0;
+    }
+
+    size_t size = sb.st_size;
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        if (fd != 0)
+            close(fd);
+        return 0;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    Worker* ws = (Worker*)calloc(workers, sizeof(Worker));
+    pthread_t tids[64];
+    for (int w = 0; w < workers; w++) {
+        ws[w].fs = (Filter**)calloc(m, sizeof(Filter*));
+        ws[w].out = (CollectF*)filter_new(sizeof(CollectF), collect_push, collect_finish);
+        ws[w].out->f.raw = 1;
+        ws[w].m = m;
+        for (int k = 0; k < m; k++)
+            stage_find(cmds[k].args[0])->open(&cmds[k], &ws[w].fs[k]);
+        for (int k = 0; k < m; k++)
+            out_init(&ws[w].fs[k]->out, -1, k < m - 1 ? ws[w].fs[k+1] : &ws[w].out->f, 256 << 10);
+    }
+
+    Out o;   // when there is nothing after the split stages
+    out_init(&o, 1, NULL, 256 << 10);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t unmapped = 0;
+
+    // the last line may have come without its newline, only raw stages go without
+    char* tail = NULL;
+    size_t tail_len = 0;
+    if (map[size-1] != '\n') {
+        char* nl = (char*)memrchr(map, '\n', size);
+        char* beg = nl ? nl + 1 : map;
+        tail_len = map + size - beg;
+        tail = (char*)malloc(tail_len + 1);
+        memcpy(tail, beg, tail_len);
+        if (!fs[0]->raw)
+            tail[tail_len++] = '\n';
+        size = beg - map;
+    }
+
+    int enough = 0;
+    for (size_t pos = 0; (pos < size || tail) && !enough; ) {
+        size_t end = size - pos > (size_t)workers * SPLIT_CHUNK ? pos + (size_t)workers * SPLIT_CHUNK : size;
+        int last_round = end == size;
+
+        char* prev = map + pos;
+        for (int w = 0; w < workers; w++) {
+            char* cut = map + pos + (end - pos) * (w + 1) / workers;
+            if (w == workers - 1)
+                cut = map + end;
+            if (cut < map + size && cut > prev) {
+                char* nl = (char*)memrchr(prev, '\n', cut - prev);
+                if (nl == NULL)   // a line longer than the range
+                    nl = (char*)memchr(cut, '\n', map + size - cut);
+                cut = nl + 1;
+            }
+            if (cut < prev)
+                cut = prev;
+            ws[w].beg = prev;
+            ws[w].end = cut;
+            ws[w].tail = NULL;
+            ws[w].last = last_round;
+            prev = cut;
+        }
+        if (last_round) {
+            ws[workers-1].tail = tail;
+            ws[workers-1].tail_len = tail_len;
+            tail = NULL;
+        }
+        end = prev - map;
+
+        for (int w = 0; w < workers - 1; w++) {
+            if (pthread_create(&tids[w], NULL, split_part, &ws[w]) != 0) {
+                split_part(&ws[w]);
+                tids[w] = 0;
+            }
+        }
+        split_part(&ws[workers-1]);
+        for (int w = 0; w < workers - 1; w++) {
+            if (tids[w])
+                pthread_join(tids[w], NULL);
+        }
+
+        // in file order into what comes next
+        for (int w = 0; w < workers && !enough; w++) {
+            CollectF* c = ws[w].out;
+            if (c->len > 0 && m < n) {
+                enough = fs[m]->push(fs[m], c->buf, c->len);
+                for (int k = m; k < n; k++)
+                    out_drain(&fs[k]->out, 0);
+                for (int k = m; k < n; k++)
+                    enough |= fs[k]->out.done;
+            } else if (c->len > 0) {
+                out_put(&o, c->buf, c->len);
+            }
+            c->len = 0;
+        }
+        pos = end;
+
+        // what tr changed in place is private memory, give it back
+        size_t upto = pos / page * page;
+        if (upto > unmapped) {
+            munmap(map + unmapped, upto - unmapped);
+            unmapped = upto;
+        }
+    }
+    out_drain(&o, 1);
+    munmap(map + unmapped, sb.st_size - unmapped);
+
+    // the status of a run of greps: 0 if any of them found something
+    if (m == n) {
+        *status = ws[0].status;
+        for (int w = 0; w < workers; w++) {
+            if (ws[w].status == 0)
+                *status = 0;
+        }
+    }
+    if (fd != 0)
+        close(fd);
+    return m;
+}
+
+/* one worker's range through its own copy of the stages */
+
+void* split_part(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    Filter** fs = w->fs;
+
+    if (w->end > w->beg)
+        fs[0]->push(fs[0], w->beg, w->end - w->beg);
+    if (w->tail)
+        fs[0]->push(fs[0], w->tail, w->tail_len);
+    if (w->last) {
+        w->status = 0;
+        for (Filter** f = fs; f < fs + w->m; f++)
+            w->status = (*f)->finish(*f);
+    } else {
+        for (Filter** f = fs; f < fs + w->m; f++)
+            out_drain(&(*f)->out, 0);
+    }
+    return NULL;
+}
+
+int collect_push(Filter* f, char* p, size_t n)
+{
+    CollectF* c = (CollectF*)f;
+
+    if (c->len + n > c->cap) {
+        while (c->len + n > c->cap)
+            c->cap = c->cap ? c->cap * 2 : 1 << 20;
+        c->buf = (char*)realloc(c->buf, c->cap);
+        if (!c->buf) {
+            fprintf(stderr, "nsh: malloc error\n");
+            _exit(2);
+        }
+    }
+    memcpy(c->buf + c->len, p, n);
+    c->len += n;
+    return 0;
+}
+
+int collect_finish(Filter* f)
+{
+    (void)f;
+    return 0;
+}
+
+/* whether the n stages from cmds on can run as a Task. a first stage
+ * with files of its own reads them blocking, that is no good
+ * on the shell's thread. neither is a regular file on fd_in,
+ * which is better off split among workers, see stage_split() */
+
+int task_able(Command* cmds, int n, int fd_in)
+{
+    struct stat sb;
+
+    if (fstat(fd_in, &sb) == 0 && S_ISREG(sb.st_mode))
+        return 0;
+    for (int k = 0; k < n; k++) {
+        if (!stage_find(cmds[k].args[0])->task)
+            return 0;
+    }
+    return stage_probe(&cmds[0]) == 0;
+}
+
+/* takes fd_in and fd_out over. the first step is taken from
+ * the event loop, so the job is never done before
+ * execute_cmd() is */
+
+void task_start(Job* job, int stage, int n, int fd_in, int fd_out)
+{
+    Command* cmds = &job->cmd->cmds[stage];
+    Task* t = (Task*)calloc(1, sizeof(Task));
+    if (!t) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    t->job = job;
+    t->stage = stage;
+    t->stages = n;
+    t->n = n;
+    t->fs = (Filter**)calloc(n, sizeof(Filter*));
+    t->fd_out = fd_out;
+    t->watch = -1;
+    t->t_start = now_ns();
+
+    for (int k = 0; k < n; k++) {
+        int ret = stage_find(cmds[k].args[0])->open(&cmds[k], &t->fs[k]);
+        if (ret != 0) {
+            // bad arguments, it ends right on its first step
+            t->status = ret << 8;
+            t->n = k;
+            t->eof = 1;
+            break;
+        }
+    }
+    for (int k = 0; k < t->n; k++) {
+        out_init(&t->fs[k]->out, fd_out, k < t->n - 1 ? t->fs[k+1] : NULL, 256 << 10);
+        t->fs[k]->out.task = 1;
+    }
+    blk_open(&t->in, NULL, 64 << 10, t->n ? t->fs[0]->raw : 0);
+    t->in.fd = fd_in;
+
+    fcntl(fd_in, F_SETFL, fcntl(fd_in, F_GETFL) | O_NONBLOCK);
+    fcntl(fd_out, F_SETFL, fcntl(fd_out, F_GETFL) | O_NONBLOCK);
+
+    // setting it up is what it has instead of a fork, for stats
+    long long setup_ns = now_ns() - t->t_start;
+    hist_add(&stats_get(cmds[0].args[0])->spawn, setup_ns / 1000);
+    for (int s = stage; s < stage + n; s++) {
+        job->runs[s].pid = getpid();
+        job->runs[s].t_spawn = t->t_start;
+    }
+    job->running++;
+    t->next = tasks;
+    tasks = t;
+    t->timer = ev_timer(0, task_resume, t);
+}
+
+/*
+ * as much as there is to do without waiting, then back to
+ * the event loop: to wait for the input pipe to have data,
+ * or the output pipe to have room. a task that always has
+ * something to do still steps aside every few blocks, as if
+ * it was waiting on a timer that is already due
+ * */
+
+/* a step, with the cpu time it takes put on the task's account.
+ * task_end() does that itself for the last one, t is gone then */
+
+void task_step(Task* t)
+{
+    t->cpu_mark = thread_cpu_ns();
+    if (task_run(t) == 0)
+        t->cpu += thread_cpu_ns() - t->cpu_mark;
+}
+
+long long thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* returns 1 once the task has ended */
+
+int task_run(Task* t)
+{
+    Filter** fs = t->fs;
+    Out* out = t->n ? &fs[t->n - 1]->out : NULL;
+
+    task_wait(t, -1, 0);
+    for (int round = 0; round < 16; round++) {
+        if (t->killed) {
+            task_end(t, t->killed);
+            return 1;
+        }
+        if (out && out->len > 0) {
+            out_drain(out, 0);
+            if (out->len > 0) {
+                task_wait(t, t->fd_out, EPOLLOUT);
+                return 0;
+            }
+        }
+        if (t->eof) {
+            task_end(t, t->status);
+            return 1;
+        }
+
+        char* p;
+        ssize_t len = blk_next(&t->in, 0, &p);
+        if (len < 0 && errno == EAGAIN) {
+            task_wait(t, t->in.fd, EPOLLIN);
+            return 0;
+        }
+
+        int enough = 0;
+        if (len > 0) {
+            enough = fs[0]->push(fs[0], p, len);
+            for (int k = 0; k < t->n - 1; k++)
+                out_drain(&fs[k]->out, 0);
+            for (int k = 0; k < t->n; k++)
+                enough |= fs[k]->out.done;
+        } else if (len < 0) {
+            t->status = 2 << 8;
+        }
+        if (len <= 0 || enough) {
+            if (t->in.fd != -1)
+                close(t->in.fd);   // a producer in front of us gets EPIPE now
+            t->in.fd = -1;
+            // what is left comes out of finish(), the last of it is written above
+            for (int k = 0; k < t->n; k++) {
+                int ret = fs[k]->finish(fs[k]);
+                if (k == t->n - 1 && t->status == 0)
+                    t->status = ret << 8;
+            }
+            t->eof = 1;
+        }
+    }
+    t->timer = ev_timer(0, task_resume, t);
+    return 0;
+}
+
+void task_resume(void* ctx)
+{
+    Task* t = (Task*)ctx;
+    t->timer = 0;
+    task_step(t);
+}
+
+void on_task(int fd, unsigned int events, void* ctx)
+{
+    (void)fd;
+    (void)events;
+    task_step((Task*)ctx);
+}
+
+/* waits for events on fd, or for nothing with fd -1 */
+
+void task_wait(Task* t, int fd, unsigned int events)
+{
+    if (t->watch != -1)
+        ev_del(t->watch);
+    t->watch = -1;
+    if (fd == -1)
+        return;
+    if (ev_add(fd, events, on_task, t) == 0)
+        t->watch = fd;
+    else
+        t->timer = ev_timer(0, task_resume, t);   // not pollable, try again right away
+}
+
+/* status is a wait() status, as if the task had been a child */
+
+void task_end(Task* t, int status)
+{
+    Job* job = t->job;
+    long long t_end = now_ns();
+
+    task_wait(t, -1, 0);
+    if (t->timer)
+        ev_timer_cancel(t->timer);
+    if (t->in.fd != -1)
+        close(t->in.fd);
+    close(t->fd_out);   // the next stage sees eof
+
+    for (int s = t->stage; s < t->stage + t->stages; s++) {
+        job->runs[s].status = status;
+        job->runs[s].t_end = t_end;
+    }
+    CmdStats* st = stats_get(job->cmd->cmds[t->stage].args[0]);
+    t->cpu += thread_cpu_ns() - t->cpu_mark;
+    hist_add(&st->wall, (t_end - t->t_start) / 1000);
+    hist_add(&st->cpu, t->cpu / 1000);
+    if (t->stage + t->stages == job->cmd->num_cmds)
+        job->status = status;
+
+    for (int k = 0; k < t->n; k++) {
+        free(t->fs[k]->out.buf);
+        if (t->fs[k]->close)
+            t->fs[k]->close(t->fs[k]);
+        free(t->fs[k]);
+    }
+    free(t->fs);
+    free(t->in.buf);
+    for (Task** p = &tasks; *p; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    free(t);
+
+    // a foreground job is freed by whoever waits for it
+    if (--job->running == 0 && job->bg) {
+        job_free(job);
+        pool_dispatch();
+    }
+}
+
+void* filter_new(size_t size, int (*push)(Filter* f, char* p, size_t n), int (*finish)(Filter* f))
+{
+    Filter* f = (Filter*)calloc(1, size);
+    if (!f) {
+        fprintf(stderr, "nsh: malloc error\n");
+        _exit(2);
+    }
+    f->push = push;
+    f->finish = finish;
+    return f;
+}
+
+void out_init(Out* o, int fd, Filter* next, size_t cap)
+{
+    o->fd = fd;
+    o->next = next;
+    o->done = 0;
+    o->task = 0;
+    o->len = 0;
+    o->cap = cap;
+    o->buf = (char*)malloc(cap);
+    if (!o->buf) {
+        fprintf(stderr, "nsh: malloc error\n");
+        _exit(2);
+    }
+}
+
+void out_put(Out* o, const char* p, size_t n)
+{
+    if (o->done)
+        return;
+    if (o->len + n <= o->cap) {
+        memcpy(o->buf + o->len, p, n);
+        o->len += n;
+        return;
+    }
+
+    out_drain(o, 0);
+    if (o->len == 0 && n >= o->cap
+        && (o->next ? p[n-1] == '\n' : !o->task)) {
+        // too big to be worth copying
+        Out direct = { o->fd, o->next, 0, o->task, (char*)p, n, n };
+        out_drain(&direct, 0);
+        o->done = direct.done;
+        return;
+    }
+    if (o->len + n > o->cap) {
+        // a line longer than the buffer, it gets its way
+        while (o->len + n > o->cap)
+            o->cap *= 2;
+        o->buf = (char*)realloc(o->buf, o->cap);
+        if (!o->buf) {
+            fprintf(stderr, "nsh: malloc error\n");
+            _exit(2);
+        }
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+/*
+ * hands on what is in the buffer: all of it to the fd or a raw
+ * stage, the whole lines of it to any other. all is for the end
+ * of the stage, where the next one gets the last line even
+ * if it has no newline, and is given one
+ *
+ * a stage has nothing sensible left to do when its output is
+ * gone, so write errors end it (EPIPE is SIGPIPE already).
+ * a Task only writes what the pipe takes, and has its output
+ * taken for done on errors, the shell has to go on
+ * */
+
+void out_drain(Out* o, int all)
+{
+    if (o->next == NULL) {
+        size_t off = 0;
+        while (off < o->len) {
+            ssize_t n = write(o->fd, o->buf + off, o->len - off);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (o->task && errno == EAGAIN)
+                    break;
+                if (!o->task) {
+                    perror("nsh: write");
+                    _exit(2);
+                }
+                if (errno != EPIPE)
+                    perror("nsh: write");
+                o->done = 1;
+                off = o->len;
+                break;
+            }
+            off += n;
+        }
+        memmove(o->buf, o->buf + off, o->len - off);
+        o->len -= off;
+        return;
+    }
+
+    if (o->done) {
+        o->len = 0;
+        return;
+    }
+    size_t n = o->len;
+    if (o->next->raw) {
+        // bytes will do
+    } else if (all && n > 0 && o->buf[n-1] != '\n') {
+        if (n == o->cap)
+            out_put(o, "\n", 1);
+        else
+            o->buf[o->len++] = '\n';
+        n = o->len;
+    } else if (!all) {
+        char* nl = (char*)memrchr(o->buf, '\n', o->len);
+        n = nl ? (size_t)(nl + 1 - o->buf) : 0;
+    }
+    if (n == 0)
+        return;
+    if (o->next->push(o->next, o->buf, n))
+        o->done = 1;
+    memmove(o->buf, o->buf + n, o->len - n);
+    o->len -= n;
+}
+
+/*
+ * sort [-rnu] [-t C] [-k N[,M]] [-S SIZE] [--parallel=N] [file...]
+ *
+ * the lines are compared byte by byte, like LC_ALL=C sort,
+ * by the whole line or the fields N to M (split at -t C, or
+ * at blanks that belong to the field after them). -n sorts
+ * by the number at the start of the key. lines with equal
+ * keys are ordered by the whole line, except with -u, which
+ * keeps the first of them
+ *
+ * the input is kept in chunks of up to half the -S budget
+ * (256M by default). a chunk is cut into one part per thread
+ * at line boundaries, and each part is sorted by its own
+ * thread. if the input doesn't fit, the chunk is merged into
+ * a sorted run in $TMPDIR and the next one is started. at the
+ * end the runs and the parts of the last chunk are merged
+ * together straight into the output
+ *
+ * options it doesn't know leave it to the real sort, and so
+ * does more than one -k, and so does any locale that doesn't
+ * collate like C
+ * */
+
+int sort_open(Command* cmd, Filter** f)
+{
+    SortKey k = { 0, 0, 0, -1, 0, 0 };
+    long long budget = 256LL << 20;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+
+    if (!c_collate())
+        return -1;
+
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        char* opt = cmd->args[i];
+        char* val = cmd->args[i+1];
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(opt, "--parallel=", 11) == 0) {
+            threads = atoi(opt + 11);
+            continue;
+        }
+        if (strcmp(opt, "-t") == 0 || strcmp(opt, "-k") == 0 || strcmp(opt, "-S") == 0) {
+            if (val == NULL)
+                return -1;
+            i++;
+            if (opt[1] == 't' && strlen(val) == 1) {
+                k.delim = (unsigned char)val[0];
+            } else if (opt[1] == 'k') {
+                /* one key, of whole fields and without flags of its
+                 * own (2.3, 2,2n): anything else is the real sort's,
+                 * a tie-break chain of keys included */
+                char* end;
+                if (k.kbeg != 0)
+                    return -1;
+                k.kbeg = strtol(val, &end, 10);
+                if (*end == ',' && (k.kend = strtol(end + 1, &end, 10)) < 1)
+                    return -1;
+                if (k.kbeg < 1 || *end != '\0' || (k.kend && k.kend < k.kbeg))
+                    return -1;
+            } else if (opt[1] == 'S' && (budget = parse_size(val)) > 0) {
+                // ok
+            } else {
+                return -1;
+            }
+            continue;
+        }
+        for (char* c = opt + 1; *c; c++) {
+            if (*c == 'r')
+                k.rev = 1;
+            else if (*c == 'n')
+                k.num = 1;
+            else if (*c == 'u')
+                k.uniq = 1;
+            else
+                return -1;
+        }
+    }
+    if (f == NULL)
+        return cmd->args[i] != NULL;
+    if (threads < 1)
+        threads = 1;
+    if (threads > 64)
+        threads = 64;
+
+    SortF* s = (SortF*)filter_new(sizeof(SortF), sort_push, sort_finish);
+    s->f.files = cmd->args[i] ? cmd->args + i : NULL;
+    s->f.block = 16 << 20;
+    s->k = k;
+    s->threads = threads;
+    s->limit = budget / 2 < 4096 ? 4096 : budget / 2;
+    *f = &s->f;
+    return 0;
+}
+
+int sort_push(Filter* f, char* p, size_t n)
+{
+    SortF* s = (SortF*)f;
+
+    while (n > 0) {
+        // as many whole lines as the chunk has room for
+        size_t take = n;
+        if (s->len + n > s->limit) {
+            char* nl = NULL;
+            if (s->len < s->limit)
+                nl = (char*)memrchr(p, '\n', s->limit - s->len);
+            if (nl != NULL)
+                take = nl + 1 - p;
+            else if (s->len > 0)
+                take = 0;
+            else
+                take = (char*)memchr(p, '\n', n) + 1 - p;   // a line longer than the budget
+        }
+
+        if (take == 0) {
+            /* the chunk is full: sort it into a run */
+            SortPart* parts;
+            int num_parts = sort_chunk(&s->k, s->buf, s->len, s->threads, &parts);
+            s->runs = (Source*)realloc(s->runs, (s->num_runs + 1) * sizeof(Source));
+            memset(&s->runs[s->num_runs], 0, sizeof(Source));
+            s->runs[s->num_runs].fd = sort_spill(&s->k, parts, num_parts);
+            s->num_runs++;
+            s->len = 0;
+            continue;
+        }
+
+        if (s->len + take > s->cap) {
+            while (s->len + take > s->cap)
+                s->cap = s->cap ? s->cap * 2 : 1 << 20;
+            s->buf = (char*)realloc(s->buf, s->cap);
+            if (!s->buf) {
+                fprintf(stderr, "nsh: malloc error\n");
+                _exit(2);
+            }
+        }
+        memcpy(s->buf + s->len, p, take);
+        s->len += take;
+        p += take;
+        n -= take;
+    }
+    return 0;
+}
+
+int sort_finish(Filter* f)
+{
+    SortF* s = (SortF*)f;
+    SortPart* parts;
+    int num_parts = sort_chunk(&s->k, s->buf, s->len, s->threads, &parts);
+    int n = s->num_runs;
+
+    s->runs = (Source*)realloc(s->runs, (n + num_parts) * sizeof(Source));
+    for (int p = 0; p < num_parts; p++) {
+        memset(&s->runs[n], 0, sizeof(Source));
+        s->runs[n].fd = -1;
+        s->runs[n].lines = parts[p].lines;
+        s->runs[n].n = parts[p].n;
+        n++;
+    }
+
+    sort_merge(&s->k, s->runs, n, &f->out);
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+/* 100, 64K, 512M, 2G */
+
+long long parse_size(char* s)
+{
+    char* end;
+    long long v = strtoll(s, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g':
+        v <<= 10;
+        // fall through
+    case 'M': case 'm':
+        v <<= 10;
+        // fall through
+    case 'K': case 'k':
+        v <<= 10;
+        end++;
+        break;
+    }
+    return *end == '\0' ? v : -1;
+}
+
+/* whether the commands we run compare strings as bytes: the
+ * first of LC_ALL, LC_COLLATE and LANG that is set decides.
+ * C.UTF-8 and the like collate by code point, which for utf-8
+ * is byte order too */
+
+int c_collate(void)
+{
+    char* vars[] = { "LC_ALL", "LC_COLLATE", "LANG" };
+
+    for (int i = 0; i < 3; i++) {
+        char* v = getenv(vars[i]);
+        if (v != NULL && *v != '\0')
+            return strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0 || strncmp(v, "C.", 2) == 0;
+    }
+    return 1;
+}
+
+/* where the field starting at s ends */
+
+const char* field_end(const char* s, const char* end, int delim)
+{
+    if (delim >= 0) {
+        const char* d = (const char*)memchr(s, delim, end - s);
+        return d ? d : end;
+    }
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    while (s < end && *s != ' ' && *s != '\t')
+        s++;
+    return s;
+}
+
+/* what sort -n takes for a number: blanks, a minus, digits and a
+ * decimal point. anything else ends it, no number at all is 0 */
+
+double parse_num(const char* s, const char* end)
+{
+    double v = 0;
+    double scale = 1;
+    int neg = 0;
+
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    if (s < end && *s == '-') {
+        neg = 1;
+        s++;
+    }
+    for (; s < end && *s >= '0' && *s <= '9'; s++)
+        v = v * 10 + (*s - '0');
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++) {
+            scale /= 10;
+            v += (*s - '0') * scale;
+        }
+    }
+    return neg ? -v : v;
+}
+
+/*
+ * sort -n on the digits themselves. a double has 53 bits, so
+ * numbers with more than 15 or so digits can come out equal
+ * when they aren't: line_cmp() asks this whenever they do
+ * */
+
+int num_cmp(const char* a, const char* ae, const char* b, const char* be)
+{
+    NumParts x, y;
+    num_parts(a, ae, &x);
+    num_parts(b, be, &y);
+
+    if (x.neg != y.neg)
+        return x.neg ? -1 : 1;
+
+    int c = (x.ilen > y.ilen) - (x.ilen < y.ilen);
+    if (c == 0)
+        c = memcmp(x.i, y.i, x.ilen);
+    for (size_t j = 0; c == 0 && (j < x.flen || j < y.flen); j++) {
+        char dx = j < x.flen ? x.f[j] : '0';
+        char dy = j < y.flen ? y.f[j] : '0';
+        c = (dx > dy) - (dx < dy);
+    }
+    return x.neg ? -c : c;
+}
+
+/* the parts of a number as parse_num() reads it, the integer
+ * digits without leading zeros. zero is never negative */
+
+void num_parts(const char* s, const char* end, NumParts* n)
+{
+    n->neg = 0;
+    while (s < end && (*s == ' ' || *s == '\t'))
+        s++;
+    if (s < end && *s == '-') {
+        n->neg = 1;
+        s++;
+    }
+    while (s < end && *s == '0')
+        s++;
+    n->i = s;
+    while (s < end && *s >= '0' && *s <= '9')
+        s++;
+    n->ilen = s - n->i;
+    n->f = s;
+    n->flen = 0;
+    if (s < end && *s == '.') {
+        n->f = ++s;
+        while (s < end && *s >= '0' && *s <= '9')
+            s++;
+        n->flen = s - n->f;
+    }
+
+    int zero = n->ilen == 0;
+    for (size_t j = 0; zero && j < n->flen; j++)
+        zero = n->f[j] == '0';
+    if (zero)
+        n->neg = 0;
+}
+
+void line_key(SortKey* k, Line* l)
+{
+    const char* end = l->p + l->len;
+    const char* s = l->p;
+    const char* e = end;
+
+    if (k->kbeg > 0) {
+        for (int f = 1; f < k->kbeg; f++) {
+            s = field_end(s, end, k->delim);
+            if (k->delim >= 0 && s < end)
+                s++;
+        }
+        if (k->kend > 0) {
+            e = s;
+            for (int f = k->kbeg; f <= k->kend; f++) {
+                e = field_end(e, end, k->delim);
+                if (f < k->kend && k->delim >= 0 && e < end)
+                    e++;
+            }
+        }
+    }
+    l->key = s;
+    l->klen = e - s;
+    if (k->num)
+        l->num = parse_num(s, e);
+
+    l->pre = 0;
+    for (int i = 0; i < 8; i++)
+        l->pre = l->pre << 8 | (i < (int)l->klen ? (unsigned char)s[i] : 0);
+}
+
+int line_cmp(SortKey* k, const Line* a, const Line* b)
+{
+    int c;
+
+    if (k->num) {
+        c = (a->num > b->num) - (a->num < b->num);
+        if (c == 0)
+            c = num_cmp(a->key, a->key + a->klen, b->key, b->key + b->klen);
+    } else if (a->pre != b->pre) {
+        c = a->pre > b->pre ? 1 : -1;
+    } else {
+        c = memcmp(a->key, b->key, a->klen < b->klen ? a->klen : b->klen);
+        if (c == 0)
+            c = (a->klen > b->klen) - (a->klen < b->klen);
+    }
+    // the last resort: the whole line, unless -u says equal is equal
+    if (c == 0 && !k->uniq && (k->num || k->kbeg)) {
+        c = memcmp(a->p, b->p, a->len < b->len ? a->len : b->len);
+        if (c == 0)
+            c = (a->len > b->len) - (a->len < b->len);
+    }
+    return k->rev ? -c : c;
+}
+
+/* a merge sort, where qsort() would call line_cmp() through
+ * a pointer and shuffle the Lines around through memcpy() */
+
+void line_sort(SortKey* k, Line* a, Line* tmp, size_t n)
+{
+    if (n <= 16) {
+        for (size_t i = 1; i < n; i++) {
+            Line l = a[i];
+            size_t j = i;
+            for (; j > 0 && line_cmp(k, &l, &a[j-1]) < 0; j--)
+                a[j] = a[j-1];
+            a[j] = l;
+        }
+        return;
+    }
+
+    size_t h = n / 2;
+    line_sort(k, a, tmp, h);
+    line_sort(k, a + h, tmp, n - h);
+    if (line_cmp(k, &a[h-1], &a[h]) <= 0)
+        return;   // already in order
+
+    // merge through tmp, taking from the left on ties to stay stable
+    memcpy(tmp, a, h * sizeof(Line));
+    size_t i = 0, j = h, o = 0;
+    while (i < h && j < n) {
+        if (line_cmp(k, &a[j], &tmp[i]) < 0)
+            a[o++] = a[j++];
+        else
+            a[o++] = tmp[i++];
+    }
+    while (i < h)
+        a[o++] = tmp[i++];
+}
+
+/* one thread's share: find the lines, their keys, sort them */
+
+void* sort_part(void* arg)
+{
+    SortPart* sp = (SortPart*)arg;
+    size_t n = 0;
+
+    for (const char* p = sp->beg; p < sp->end; p++) {
+        p = (const char*)memchr(p, '\n', sp->end - p);
+        n++;
+    }
+    sp->lines = (Line*)malloc((n ? n : 1) * sizeof(Line));
+    if (!sp->lines) {
+        fprintf(stderr, "nsh: malloc error\n");
+        _exit(2);
+    }
+
+    n = 0;
+    for (const char* p = sp->beg; p < sp->end; ) {
+        const char* nl = (const char*)memchr(p, '\n', sp->end - p);
+        Line* l = &sp->lines[n++];
+        l->p = p;
+        l->len = nl - p;
+        line_key(sp->k, l);
+        p = nl + 1;
+    }
+    sp->n = n;
+
+    Line* tmp = (Line*)malloc((n / 2 + 1) * sizeof(Line));
+    if (!tmp) {
+        fprintf(stderr, "nsh: malloc error\n");
+        _exit(2);
+    }
+    line_sort(sp->k, sp->lines, tmp, n);
+    free(tmp);
+    return NULL;
+}
+
+/* sorts buf (whole lines only) in up to threads parts, a
+ * thread each. small inputs aren't worth a thread */
+
+int sort_chunk(SortKey* k, const char* buf, size_t len, int threads, SortPart** parts)
+{
+    if (len < ((size_t)1 << 20))
+        threads = 1;
+
+    SortPart* sp = (SortPart*)calloc(threads, sizeof(SortPart));
+    pthread_t* tids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    const char* p = buf;
+    const char* end = buf + len;
+    int n = 0;
+
+    for (int t = 0; t < threads && p < end; t++) {
+        const char* cut = end;
+        if (t < threads - 1) {
+            cut = p + (end - p) / (threads - t);
+            cut = (const char*)memchr(cut, '\n', end - cut);
+            cut = cut ? cut + 1 : end;
+        }
+        sp[n].k = k;
+        sp[n].beg = p;
+        sp[n].end = cut;
+        n++;
+        p = cut;
+    }
+
+    // the last part is ours, the others get a thread each
+    for (int t = 0; t < n - 1; t++) {
+        if (pthread_create(&tids[t], NULL, sort_part, &sp[t]) != 0) {
+            sort_part(&sp[t]);
+            tids[t] = 0;
+        }
+    }
+    if (n > 0)
+        sort_part(&sp[n-1]);
+    for (int t = 0; t < n - 1; t++) {
+        if (tids[t])
+            pthread_join(tids[t], NULL);
+    }
+
+    free(tids);
+    *parts = sp;
+    return n;
+}
+
+/* moves s on to its next line, 0 when there are none left */
+
+int src_next(SortKey* k, Source* s)
+{
+    if (s->fd == -1) {
+        if (s->i == s->n)
+            return 0;
+        s->cur = s->lines[s->i++];
+        return 1;
+    }
+
+    for (;;) {
+        char* nl = (char*)memchr(s->buf + s->off, '\n', s->len - s->off);
+        if (nl != NULL) {
+            s->cur.p = s->buf + s->off;
+            s->cur.len = nl - (s->buf + s->off);
+            s->off += s->cur.len + 1;
+            line_key(k, &s->cur);
+            return 1;
+        }
+
+        memmove(s->buf, s->buf + s->off, s->len - s->off);
+        s->len -= s->off;
+        s->off = 0;
+        if (s->len == s->cap) {
+            s->cap = s->cap ? s->cap * 2 : 1 << 20;
+            s->buf = (char*)realloc(s->buf, s->cap);
+            if (!s->buf) {
+                fprintf(stderr, "nsh: malloc error\n");
+                _exit(2);
+            }
+        }
+        ssize_t n = read(s->fd, s->buf + s->len, s->cap - s->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("nsh: sort");
+            _exit(2);
+        }
+        if (n == 0)
+            return 0;   // runs are written by us, always whole lines
+        s->len += n;
+    }
+}
+
+/* k-way merge through a binary heap of the sources */
+
+void sort_merge(SortKey* k, Source* srcs, int num, Out* o)
+{
+    Source** heap = (Source**)malloc((num ? num : 1) * sizeof(Source*));
+    int n = 0;
+    char* prev = NULL;
+    size_t prev_cap = 0;
+    Line last;
+    int have_last = 0;
+
+    #define SRC_LESS(a, b) (line_cmp(k, &(a)->cur, &(b)->cur) < 0 \
+                            || (line_cmp(k, &(a)->cur, &(b)->cur) == 0 && (a)->idx < (b)->idx))
+
+    for (int i = 0; i < num; i++) {
+        srcs[i].idx = i;
+        if (!src_next(k, &srcs[i]))
+            continue;
+        // sift up
+        int j = n++;
+        while (j > 0 && SRC_LESS(&srcs[i], heap[(j-1)/2])) {
+            heap[j] = heap[(j-1)/2];
+            j = (j-1)/2;
+        }
+        heap[j] = &srcs[i];
+    }
+
+    while (n > 0 && !o->done) {
+        Source* s = heap[0];
+
+        if (!k->uniq || !have_last || line_cmp(k, &last, &s->cur) != 0) {
+            out_put(o, s->cur.p, s->cur.len);
+            out_put(o, "\n", 1);
+            if (k->uniq) {
+                // the source's buffer moves on, keep a copy to compare to
+                if (s->cur.len + 1 > prev_cap) {
+                    prev_cap = s->cur.len + 1;
+                    prev = (char*)realloc(prev, prev_cap);
+                }
+                memcpy(prev, s->cur.p, s->cur.len);
+                last.p = prev;
+                last.len = s->cur.len;
+                line_key(k, &last);
+                have_last = 1;
+            }
+        }
+
+        if (!src_next(k, s))
+            s = heap[--n];
+        // sift down
+        int j = 0;
+        for (;;) {
+            int c = 2 * j + 1;
+            if (c >= n)
+                break;
+            if (c + 1 < n && SRC_LESS(heap[c+1], heap[c]))
+                c++;
+            if (!SRC_LESS(heap[c], s))
+                break;
+            heap[j] = heap[c];
+            j = c;
+        }
+        if (n > 0)
+            heap[j] = s;
+    }
+    #undef SRC_LESS
+
+    free(prev);
+    free(heap);
+}
+
+/* merges the sorted parts of a chunk into an unlinked temp file,
+ * returns it rewound for reading */
+
+int sort_spill(SortKey* k, SortPart* parts, int n)
+{
+    char* dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/nsh-sort.XXXXXX", dir && *dir ? dir : "/tmp");
+
+    int tfd = mkstemp(path);
+    if (tfd == -1) {
+        perror("nsh: sort");
+        _exit(2);
+    }
+    unlink(path);
+
+    Source* srcs = (Source*)calloc(n, sizeof(Source));
+    for (int p = 0; p < n; p++) {
+        srcs[p].fd = -1;
+        srcs[p].lines = parts[p].lines;
+        srcs[p].n = parts[p].n;
+    }
+
+    Out o;
+    out_init(&o, tfd, NULL, 1 << 20);
+    sort_merge(k, srcs, n, &o);
+    out_drain(&o, 1);
+    free(o.buf);
+
+    for (int p = 0; p < n; p++)
+        free(parts[p].lines);
+    free(parts);
+    free(srcs);
+
+    lseek(tfd, 0, SEEK_SET);
+    return tfd;
+}
+
+/* no files is stdin, same as a lone "-" */
+
+int blk_open(Blocks* b, char** files, size_t cap, int raw)
+{
+    static char* stdin_only[] = { "-", NULL };
+
+    b->files = files && *files ? files : stdin_only;
+    b->fd = -1;
+    b->raw = raw;
+    b->len = b->used = 0;
+    b->cap = cap;
+    b->buf = (char*)malloc(cap + 1);
+    if (!b->buf) {
+        fprintf(stderr, "nsh: malloc error\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * the next block of whole lines into *p, returns its length,
+ * 0 when the input is over or -1 on errors. with fill it
+ * waits for a full buffer, else it returns as soon as a line
+ * is complete, which is what a stage in front of a slow
+ * producer wants. the last line of a file gets its newline
+ * if it came without one. raw blocks are whatever was read.
+ * a nonblocking fd with nothing to read is -1 with EAGAIN
+ * */
+
+ssize_t blk_next(Blocks* b, int fill, char** p)
+{
+    memmove(b->buf, b->buf + b->used, b->len - b->used);
+    b->len -= b->used;
+    b->used = 0;
+
+    for (;;) {
+        char* nl = NULL;
+        if (b->raw && b->len > 0)
+            nl = b->buf + b->len - 1;
+        else if (b->len > 0)
+            nl = (char*)memrchr(b->buf, '\n', b->len);
+        if (nl != NULL && (!fill || b->len == b->cap || *b->files == NULL)) {
+            *p = b->buf;
+            b->used = nl + 1 - b->buf;
+            return b->used;
+        }
+        if (*b->files == NULL)
+            return 0;
+
+        if (b->len == b->cap) {
+            // a line longer than the buffer
+            b->cap *= 2;
+            b->buf = (char*)realloc(b->buf, b->cap + 1);
+            if (!b->buf) {
+                fprintf(stderr, "nsh: malloc error\n");
+                return -1;
+            }
+        }
+
+        if (b->fd == -1) {
+            b->fd = 0;
+            if (strcmp(*b->files, "-") != 0 && (b->fd = open(*b->files, O_RDONLY)) == -1) {
+                fprintf(stderr, "nsh: %s: %s\n", *b->files, strerror(errno));
+                return -1;
+            }
+        }
+
+        ssize_t n = read(b->fd, b->buf + b->len, b->cap - b->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return -1;   // a Task's pipe, nothing there yet
+        if (n < 0) {
+            fprintf(stderr, "nsh: %s: %s\n", *b->files, strerror(errno));
+            return -1;
+        }
+        b->len += n;
+        if (n == 0) {
+            if (!b->raw && b->len > 0 && b->buf[b->len-1] != '\n')
+                b->buf[b->len++] = '\n';   // buf has the room, see blk_open()
+            if (b->fd != 0)
+                close(b->fd);
+            b->fd = -1;
+            b->files++;
+        }
+    }
+}
+
+/*
+ * count [-f N] [-t C] [--parallel=N] [file...]
+ *
+ * counts how often each line (or its field N) comes up and
+ * prints the counts most frequent first, like
+ * sort | uniq -c | sort -rn does, ties in the same order
+ * (the locale's, like sort's, when it doesn't collate as C).
+ * fields are split at -t C, or at runs of blanks like awk
+ * does. without -t the field is what awk's $N would be.
+ *
+ * the input comes in blocks of 16M, each thread counts a
+ * part of it into a table of its own, and the tables are
+ * added up at the end. a table is open addressing, with the
+ * hash and the length next to the key pointer so that a
+ * probe only touches the key when it is most likely a hit
+ * */
+
+int count_open(Command* cmd, Filter** f)
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int field = 0;
+    int delim = -1;
+    int i = 1;
+
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        char* opt = cmd->args[i];
+        char* val = cmd->args[i+1];
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(opt, "--parallel=", 11) == 0) {
+            threads = atoi(opt + 11);
+        } else if (strcmp(opt, "-f") == 0 && val != NULL && atoi(val) > 0) {
+            field = atoi(val);
+            i++;
+        } else if (strcmp(opt, "-t") == 0 && val != NULL && strlen(val) == 1) {
+            delim = (unsigned char)val[0];
+            i++;
+        } else {
+            if (f != NULL)
+                fprintf(stderr, "nsh: count usage: count [-f N] [-t C] [--parallel=N] [file...]\n");
+            return f ? 2 : 0;
+        }
+    }
+    if (f == NULL)
+        return cmd->args[i] != NULL;
+    if (threads < 1)
+        threads = 1;
+    if (threads > 64)
+        threads = 64;
+
+    CountF* c = (CountF*)filter_new(sizeof(CountF), count_push, count_finish);
+    c->f.files = cmd->args[i] ? cmd->args + i : NULL;
+    c->f.block = 16 << 20;
+    c->threads = threads;
+    c->coll = !c_collate();
+    c->tabs = (CountTab*)calloc(threads, sizeof(CountTab));
+    for (int t = 0; t < threads; t++) {
+        c->tabs[t].field = field;
+        c->tabs[t].delim = delim;
+    }
+    *f = &c->f;
+    return 0;
+}
+
+int count_push(Filter* f, char* p, size_t len)
+{
+    CountF* c = (CountF*)f;
+    CountTab* tabs = c->tabs;
+    pthread_t tids[64];
+    int n = len < (1 << 20) ? 1 : c->threads;
+    const char* end = p + len;
+
+    // cut the block at line boundaries, a part per thread
+    for (int t = 0; t < n; t++) {
+        const char* cut = end;
+        if (t < n - 1) {
+            cut = p + (end - p) / (n - t);
+            cut = (const char*)memchr(cut, '\n', end - cut);
+            cut = cut ? cut + 1 : end;
+        }
+        tabs[t].beg = p;
+        tabs[t].end = cut;
+        p = (char*)cut;
+    }
+
+    for (int t = 0; t < n - 1; t++) {
+        if (pthread_create(&tids[t], NULL, count_part, &tabs[t]) != 0) {
+            count_part(&tabs[t]);
+            tids[t] = 0;
+        }
+    }
+    count_part(&tabs[n-1]);
+    for (int t = 0; t < n - 1; t++) {
+        if (tids[t])
+            pthread_join(tids[t], NULL);
+    }
+    return 0;
+}
+
+int count_finish(Filter* f)
+{
+    CountF* c = (CountF*)f;
+
+    // add everything up in the first table
+    for (int t = 1; t < c->threads; t++) {
+        for (size_t s = 0; s < c->tabs[t].cap; s++) {
+            CountSlot* cs = &c->tabs[t].tab[s];
+            if (cs->key)
+                count_add(&c->tabs[0], cs->key, cs->len, cs->hash, cs->n, 0);
+        }
+    }
+
+    CountTab* t = &c->tabs[0];
+    size_t n = 0;
+    for (size_t s = 0; s < t->cap; s++) {
+        if (t->tab[s].key)
+            t->tab[n++] = t->tab[s];
+    }
+    if (c->coll) {
+        /* strcoll() wants strings: the keys get a \0 each, in
+         * copies that live as long as the stage */
+        setlocale(LC_COLLATE, "");
+        size_t total = 0;
+        for (size_t s = 0; s < n; s++)
+            total += t->tab[s].len + 1;
+        char* copy = (char*)malloc(total ? total : 1);
+        if (!copy) {
+            fprintf(stderr, "nsh: malloc error\n");
+            _exit(2);
+        }
+        for (size_t s = 0; s < n; s++) {
+            memcpy(copy, t->tab[s].key, t->tab[s].len);
+            copy[t->tab[s].len] = '\0';
+            t->tab[s].key = copy;
+            copy += t->tab[s].len + 1;
+        }
+        qsort(t->tab, n, sizeof(CountSlot), count_cmp_coll);
+    } else {
+        qsort(t->tab, n, sizeof(CountSlot), count_cmp);
+    }
+
+    for (size_t s = 0; s < n && !f->out.done; s++) {
+        char num[32];
+        int w = snprintf(num, sizeof(num), "%7llu ", t->tab[s].n);
+        out_put(&f->out, num, w);
+        out_put(&f->out, t->tab[s].key, t->tab[s].len);
+        out_put(&f->out, "\n", 1);
+    }
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+/* 8 bytes at a time, multiply and xor-shift. only has to
+ * be good enough for a power of two table */
+
+unsigned long long hash_mem(const char* p, size_t n)
+{
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ n;
+    unsigned long long w;
+
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+void count_add(CountTab* t, const char* key, size_t len, unsigned long long hash,
+               unsigned long long n, int copy)
+{
+    if (t->len + 1 > t->cap / 4 * 3) {
+        size_t cap = t->cap ? t->cap * 2 : 4096;
+        CountSlot* tab = (CountSlot*)calloc(cap, sizeof(CountSlot));
+        if (!tab) {
+            fprintf(stderr, "nsh: malloc error\n");
+            _exit(2);
+        }
+        for (size_t s = 0; s < t->cap; s++) {
+            if (t->tab[s].key == NULL)
+                continue;
+            size_t j = t->tab[s].hash & (cap - 1);
+            while (tab[j].key)
+                j = (j + 1) & (cap - 1);
+            tab[j] = t->tab[s];
+        }
+        free(t->tab);
+        t->tab = tab;
+        t->cap = cap;
+    }
+
+    size_t j = hash & (t->cap - 1);
+    for (; t->tab[j].key; j = (j + 1) & (t->cap - 1)) {
+        CountSlot* c = &t->tab[j];
+        if (c->hash == hash && c->len == len && memcmp(c->key, key, len) == 0) {
+            c->n += n;
+            return;
+        }
+    }
+
+    if (copy) {
+        // into the arena, a new block when it is full
+        if (t->arena == NULL || t->arena_off + len + 1 > t->arena_cap) {
+            t->arena_cap = len + 1 > (1 << 20) ? len + 1 : (1 << 20);
+            t->arena = (char*)malloc(t->arena_cap);
+            t->arena_off = 0;
+            if (!t->arena) {
+                fprintf(stderr, "nsh: malloc error\n");
+                _exit(2);
+            }
+        }
+        char* k = t->arena + t->arena_off;
+        memcpy(k, key, len);
+        k[len] = '\0';  // a key can be empty, key == NULL means a free slot
+        t->arena_off += len + 1;
+        key = k;
+    }
+    t->tab[j].hash = hash;
+    t->tab[j].key = key;
+    t->tab[j].len = len;
+    t->tab[j].n = n;
+    t->len++;
+}
+
+void* count_part(void* arg)
+{
+    CountTab* t = (CountTab*)arg;
+    const char* p = t->beg;
+
+    while (p < t->end) {
+        const char* nl = (const char*)memchr(p, '\n', t->end - p);
+        const char* key = p;
+        const char* kend = nl;
+
+        if (t->field > 0 && t->delim >= 0) {
+            for (int f = 1; f < t->field && key < nl; f++) {
+                key = field_end(key, nl, t->delim);
+                if (key < nl)
+                    key++;
+            }
+            kend = key < nl ? field_end(key, nl, t->delim) : nl;
+        } else if (t->field > 0) {
+            for (int f = 1; f < t->field; f++)
+                key = field_end(key, nl, -1);
+            while (key < nl && (*key == ' ' || *key == '\t'))
+                key++;
+            kend = field_end(key, nl, -1);
+        }
+
+        count_add(t, key, kend - key, hash_mem(key, kend - key), 1, 1);
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/* most frequent first, then what sort -rn does with
+ * "  count key" lines: the key backwards */
+
+int count_cmp(const void* a, const void* b)
+{
+    const CountSlot* x = (const CountSlot*)a;
+    const CountSlot* y = (const CountSlot*)b;
+
+    if (x->n != y->n)
+        return x->n > y->n ? -1 : 1;
+    int c = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+    if (c == 0)
+        c = (x->len > y->len) - (x->len < y->len);
+    return -c;
+}
+
+/* the same, with the keys \0-terminated and collated */
+
+int count_cmp_coll(const void* a, const void* b)
+{
+    const CountSlot* x = (const CountSlot*)a;
+    const CountSlot* y = (const CountSlot*)b;
+
+    if (x->n != y->n)
+        return x->n > y->n ? -1 : 1;
+    return -strcoll(x->key, y->key);
+}
+
+/*
+ * fields [-t C] [-o SEP] LIST [file...]
+ *
+ * prints the fields in LIST of every line: N, N-M or N-,
+ * comma separated, in the order given like awk's print.
+ * fields are split at -t C, or at runs of blanks with the
+ * leading ones ignored, which makes "fields 3" the same as
+ * awk '{print $3}'. the output separator is -o, or the -t
+ * delimiter, or a space. a field the line doesn't have
+ * prints as nothing
+ * */
+
+int fields_open(Command* cmd, Filter** f)
+{
+    FieldsF s;
+    int i = 1;
+    char* list = NULL;
+
+    memset(&s, 0, sizeof(s));
+    s.delim = -1;
+    for (; cmd->args[i] != NULL; i++) {
+        char* opt = cmd->args[i];
+        char* val = cmd->args[i+1];
+
+        if (strcmp(opt, "-t") == 0 && val != NULL && strlen(val) == 1) {
+            s.delim = (unsigned char)val[0];
+            if (s.ofs == NULL)
+                s.ofs = val;
+            i++;
+        } else if (strcmp(opt, "-o") == 0 && val != NULL) {
+            // -o wins over -t, in either order
+            s.ofs = val;
+            i++;
+        } else if (opt[0] != '-' && list == NULL) {
+            list = opt;
+        } else {
+            break;
+        }
+    }
+    if (list == NULL || fields_parse(&s, list) == -1
+        || (cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0')) {
+        free(s.sel);
+        if (f != NULL)
+            fprintf(stderr, "nsh: fields usage: fields [-t c] [-o sep] N[-M],... [file...]\n");
+        return f ? 2 : 0;
+    }
+    if (f == NULL) {
+        free(s.sel);
+        return cmd->args[i] != NULL;
+    }
+    if (s.ofs == NULL)
+        s.ofs = " ";
+
+    FieldsF* fs = (FieldsF*)filter_new(sizeof(FieldsF), fields_push, fields_finish);
+    fs->f.close = fields_close;
+    s.f = fs->f;
+    *fs = s;
+    fs->f.files = cmd->args[i] ? cmd->args + i : NULL;
+    fs->f.split = 1;
+    *f = &fs->f;
+    return 0;
+}
+
+int fields_parse(FieldsF* fs, char* list)
+{
+    for (char* s = list; *s; ) {
+        char* end;
+        FieldSel f;
+
+        f.lo = strtol(s, &end, 10);
+        f.hi = f.lo;
+        if (end == s || f.lo < 1)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            f.hi = strtol(s, &end, 10);
+            if (end == s)
+                f.hi = INT_MAX;
+            else if (f.hi < f.lo)
+                return -1;
+        }
+        if (*end != ',' && *end != '\0')
+            return -1;
+        s = *end ? end + 1 : end;
+
+        fs->sel = (FieldSel*)realloc(fs->sel, (fs->num_sel + 1) * sizeof(FieldSel));
+        fs->sel[fs->num_sel++] = f;
+        if (f.hi > fs->need)
+            fs->need = f.hi;
+    }
+    return fs->num_sel > 0 ? 0 : -1;
+}
+
+/*
+ * the block is scanned a vector at a time for the delimiter
+ * (or blanks) and newlines at once, which gives a bit mask of
+ * where they are. the loop then only looks at the positions
+ * in the mask instead of at every byte
+ * */
+
+int fields_push(Filter* f, char* p, size_t len)
+{
+    FieldsF* fs = (FieldsF*)f;
+    const char* end = p + len;
+    int nf = 0;
+    int blanks = fs->delim < 0;
+    char d1 = blanks ? ' ' : fs->delim;
+    char d2 = blanks ? '\t' : fs->delim;
+    const char* start = p;   // of the field we are in
+    size_t ofs_len = strlen(fs->ofs);
+
+#if defined(__AVX2__)
+    const int width = 32;
+    __m256i v_nl = _mm256_set1_epi8('\n');
+    __m256i v_d1 = _mm256_set1_epi8(d1);
+    __m256i v_d2 = _mm256_set1_epi8(d2);
+#elif defined(__SSE2__)
+    const int width = 16;
+    __m128i v_nl = _mm_set1_epi8('\n');
+    __m128i v_d1 = _mm_set1_epi8(d1);
+    __m128i v_d2 = _mm_set1_epi8(d2);
+#else
+    const int width = 32;
+#endif
+
+    for (const char* base = p; base < end; base += width) {
+        unsigned int mask = 0;
+
+        if (end - base >= width) {
+#if defined(__AVX2__)
+            __m256i v = _mm256_loadu_si256((const __m256i*)base);
+            __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, v_nl),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, v_d1), _mm256_cmpeq_epi8(v, v_d2)));
+            mask = _mm256_movemask_epi8(m);
+#elif defined(__SSE2__)
+            __m128i v = _mm_loadu_si128((const __m128i*)base);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, v_nl),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, v_d1), _mm_cmpeq_epi8(v, v_d2)));
+            mask = _mm_movemask_epi8(m);
+#else
+            for (int k = 0; k < width; k++) {
+                if (base[k] == '\n' || base[k] == d1 || base[k] == d2)
+                    mask |= 1u << k;
+            }
+#endif
+        } else {
+            // the tail, byte by byte
+            for (int k = 0; k < end - base; k++) {
+                if (base[k] == '\n' || base[k] == d1 || base[k] == d2)
+                    mask |= 1u << k;
+            }
+        }
+
+        for (; mask; mask &= mask - 1) {
+            const char* at = base + __builtin_ctz(mask);
+
+            // a field ends here. blanks in a row only end the first one
+            if (!(blanks && at == start) && nf < fs->need) {
+                if (nf == fs->cap) {
+                    fs->cap = fs->cap ? fs->cap * 2 : 64;
+                    fs->beg = (const char**)realloc(fs->beg, fs->cap * sizeof(char*));
+                    fs->end = (const char**)realloc(fs->end, fs->cap * sizeof(char*));
+                }
+                fs->beg[nf] = start;
+                fs->end[nf] = at;
+                nf++;
+            } else if (!(blanks && at == start)) {
+                nf++;
+            }
+            start = at + 1;
+            if (*at != '\n')
+                continue;
+
+            // the line is over, print it
+            int first = 1;
+            for (int s = 0; s < fs->num_sel; s++) {
+                int hi = fs->sel[s].hi == INT_MAX ? nf : fs->sel[s].hi;
+                for (int k = fs->sel[s].lo; k <= hi; k++) {
+                    if (!first)
+                        out_put(&f->out, fs->ofs, ofs_len);
+                    first = 0;
+                    if (k <= nf && k <= fs->need)
+                        out_put(&f->out, fs->beg[k-1], fs->end[k-1] - fs->beg[k-1]);
+                }
+            }
+            out_put(&f->out, "\n", 1);
+            nf = 0;
+            if (f->out.done)
+                return 1;
+        }
+    }
+    return f->out.done;
+}
+
+int fields_finish(Filter* f)
+{
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+void fields_close(Filter* f)
+{
+    FieldsF* fs = (FieldsF*)f;
+    free(fs->sel);
+    free(fs->beg);
+    free(fs->end);
+}
+
+/*
+ * tr [-cds] SET1 [SET2]
+ *
+ * translates the bytes in SET1 to the ones in SET2 (its last
+ * one repeated if it is shorter), -d deletes those in SET1,
+ * -s squeezes runs of a byte in the last set given down to
+ * one, -c takes SET1's complement. sets have ranges (a-z),
+ * escapes (\n \t \r \\ \NNN) and [:alpha:] [:alnum:]
+ * [:digit:] [:lower:] [:upper:] [:space:] [:blank:] [:punct:].
+ * translating with -c is left to the real tr.
+ *
+ * all of it is a lookup in 256-entry tables, done in place
+ * on the blocks as they come
+ * */
+
+int tr_open(Command* cmd, Filter** f)
+{
+    int comp = 0, del = 0, sq = 0;
+    int i = 1;
+    unsigned char s1[4096], s2[4096];
+    int n1, n2 = 0;
+
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        if (strcmp(cmd->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* c = cmd->args[i] + 1; *c; c++) {
+            if (*c == 'c' || *c == 'C')
+                comp = 1;
+            else if (*c == 'd')
+                del = 1;
+            else if (*c == 's')
+                sq = 1;
+            else
+                return -1;
+        }
+    }
+
+    char* a1 = cmd->args[i];
+    char* a2 = a1 ? cmd->args[i+1] : NULL;
+    if (a1 == NULL || (a2 && cmd->args[i+2]) || (!del && !sq && !a2) || (del && !sq && a2)
+        || (comp && a2 && !del))
+        return -1;
+    if ((n1 = tr_set(a1, s1, sizeof(s1))) < 0 || (a2 && (n2 = tr_set(a2, s2, sizeof(s2))) < 0))
+        return -1;
+    if (f == NULL)
+        return 0;
+
+    if (comp) {
+        unsigned char in[256] = { 0 };
+        for (int k = 0; k < n1; k++)
+            in[s1[k]] = 1;
+        n1 = 0;
+        for (int c = 0; c < 256; c++) {
+            if (!in[c])
+                s1[n1++] = c;
+        }
+    }
+
+    TrF* t = (TrF*)filter_new(sizeof(TrF), tr_push, tr_finish);
+    t->f.raw = 1;
+    t->last = -1;
+    for (int c = 0; c < 256; c++)
+        t->map[c] = c;
+    t->translate = !del && a2 != NULL;
+    t->del = del;
+    t->sq = sq;
+    if (t->translate) {
+        for (int k = 0; k < n1; k++)
+            t->map[s1[k]] = n2 ? s2[k < n2 ? k : n2 - 1] : s1[k];
+    }
+    if (del) {
+        for (int k = 0; k < n1; k++)
+            t->dmap[s1[k]] = 0xff;
+    }
+    if (sq) {
+        // the last set given, after translating
+        unsigned char* s = a2 ? s2 : s1;
+        int n = a2 ? n2 : n1;
+        for (int k = 0; k < n; k++)
+            t->smap[s[k]] = 0xff;
+    }
+    // squeezing goes across lines, and so does a newline changed
+    t->f.split = !sq && t->map['\n'] == '\n' && !t->dmap['\n'];
+    *f = &t->f;
+    return 0;
+}
+
+int tr_push(Filter* f, char* p, size_t len)
+{
+    TrF* t = (TrF*)f;
+    unsigned char* b = (unsigned char*)p;
+
+    if (t->translate)
+        tr_translate(t->map, b, len);
+    if (t->del)
+        len = tr_delete(t->dmap, b, len);
+    if (t->sq) {
+        size_t j = 0;
+        for (size_t k = 0; k < len; k++) {
+            if (b[k] == t->last && t->smap[b[k]])
+                continue;
+            t->last = b[k];
+            b[j++] = b[k];
+        }
+        len = j;
+    }
+    out_put(&f->out, p, len);
+    return f->out.done;
+}
+
+int tr_finish(Filter* f)
+{
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+/* expands a set into out, -1 if it is more than max bytes or
+ * has something we don't know */
+
+int tr_set(const char* s, unsigned char* out, int max)
+{
+    static const struct { const char* name; const char* ranges; } classes[] = {
+        { "[:alpha:]", "AZaz" }, { "[:alnum:]", "09AZaz" }, { "[:digit:]", "09" },
+        { "[:lower:]", "az" }, { "[:upper:]", "AZ" }, { "[:space:]", "\t\r  " },
+        { "[:blank:]", "\t\t  " }, { "[:punct:]", "!/:@[`{~" },
+    };
+    int n = 0;
+
+    while (*s) {
+        size_t k;
+        for (k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+            size_t len = strlen(classes[k].name);
+            if (strncmp(s, classes[k].name, len) == 0) {
+                for (const char* r = classes[k].ranges; *r; r += 2) {
+                    for (int c = (unsigned char)r[0]; c <= (unsigned char)r[1]; c++) {
+                        if (n == max)
+                            return -1;
+                        out[n++] = c;
+                    }
+                }
+                s += len;
+                break;
+            }
+        }
+        if (k < sizeof(classes) / sizeof(classes[0]))
+            continue;
+        if (s[0] == '[' && s[1] == ':')
+            return -1;
+        // [=c=], [c*n] and [c*] are the real tr's
+        if (s[0] == '[' && s[1] != '\0') {
+            const char* r = s + 1;
+            if (*r == '=' || (tr_char(&r), *r == '*'))
+                return -1;
+        }
+
+        // one byte, or a range of them
+        int lo = tr_char(&s);
+        int hi = lo;
+        if (s[0] == '-' && s[1] != '\0') {
+            s++;
+            hi = tr_char(&s);
+            if (hi < lo)
+                return -1;
+        }
+        for (int c = lo; c <= hi; c++) {
+            if (n == max)
+                return -1;
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+/* a byte of a set, escapes taken care of */
+
+int tr_char(const char** sp)
+{
+    const char* s = *sp;
+    int c;
+
+    if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7') {
+        c = 0;
+        for (s++; s - *sp <= 3 && *s >= '0' && *s <= '7'; s++)
+            c = c * 8 + (*s - '0');
+    } else if (s[0] == '\\' && s[1] != '\0') {
+        switch (s[1]) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        default: c = (unsigned char)s[1]; break;
+        }
+        s += 2;
+    } else {
+        c = (unsigned char)*s++;
+    }
+    *sp = s;
+    return c & 0xff;
+}
+
+/*
+ * a 256-byte table is 16 tables of 16, one per high nibble,
+ * and pshufb looks up 16 (or 32) bytes in a 16-byte table at
+ * once by their low nibble. a byte takes the result from the
+ * table of its own high nibble. tables that map every byte to
+ * itself are skipped, so a-z to A-Z is two lookups per vector.
+ * the check is at compile time: without -mssse3 (or a -march
+ * that has it, like native) only the plain loop is built
+ * */
+
+void tr_translate(const unsigned char* map, unsigned char* p, size_t n)
+{
+    size_t k = 0;
+
+#if defined(__SSSE3__)
+    int hot[16];
+    int num_hot = 0;
+    for (int h = 0; h < 16; h++) {
+        for (int l = 0; l < 16; l++) {
+            if (map[h * 16 + l] != h * 16 + l) {
+                hot[num_hot++] = h;
+                break;
+            }
+        }
+    }
+
+#if defined(__AVX2__)
+    __m256i tabs[16];
+    for (int h = 0; h < num_hot; h++)
+        tabs[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(map + hot[h] * 16)));
+    __m256i nib = _mm256_set1_epi8(0x0f);
+    for (; k + 32 <= n; k += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + k));
+        __m256i lo = _mm256_and_si256(v, nib);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+        for (int h = 0; h < num_hot; h++) {
+            __m256i m = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(hot[h]));
+            v = _mm256_blendv_epi8(v, _mm256_shuffle_epi8(tabs[h], lo), m);
+        }
+        _mm256_storeu_si256((__m256i*)(p + k), v);
+    }
+#else
+    __m128i tabs[16];
+    for (int h = 0; h < num_hot; h++)
+        tabs[h] = _mm_loadu_si128((const __m128i*)(map + hot[h] * 16));
+    __m128i nib = _mm_set1_epi8(0x0f);
+    for (; k + 16 <= n; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + k));
+        __m128i lo = _mm_and_si128(v, nib);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+        for (int h = 0; h < num_hot; h++) {
+            __m128i m = _mm_cmpeq_epi8(hi, _mm_set1_epi8(hot[h]));
+            __m128i t = _mm_shuffle_epi8(tabs[h], lo);
+            v = _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, v));
+        }
+        _mm_storeu_si128((__m128i*)(p + k), v);
+    }
+#endif
+#endif
+
+    for (; k < n; k++)
+        p[k] = map[p[k]];
+}
+
+/* deletes in place, returns the new length. with ssse3 the
+ * deleted bytes are found a vector at a time like above, and
+ * vectors without any are moved down as a whole */
+
+size_t tr_delete(const unsigned char* del, unsigned char* p, size_t n)
+{
+    size_t j = 0;
+    size_t k = 0;
+
+#if defined(__SSSE3__)
+    int hot[16];
+    int num_hot = 0;
+    __m128i tabs[16];
+    for (int h = 0; h < 16; h++) {
+        for (int l = 0; l < 16; l++) {
+            if (del[h * 16 + l]) {
+                tabs[num_hot] = _mm_loadu_si128((const __m128i*)(del + h * 16));
+                hot[num_hot++] = h;
+                break;
+            }
+        }
+    }
+    __m128i nib = _mm_set1_epi8(0x0f);
+    for (; k + 16 <= n; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + k));
+        __m128i lo = _mm_and_si128(v, nib);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nib);
+        __m128i d = _mm_setzero_si128();
+        for (int h = 0; h < num_hot; h++) {
+            __m128i m = _mm_cmpeq_epi8(hi, _mm_set1_epi8(hot[h]));
+            d = _mm_or_si128(d, _mm_and_si128(m, _mm_shuffle_epi8(tabs[h], lo)));
+        }
+        if (_mm_movemask_epi8(d) == 0) {
+            _mm_storeu_si128((__m128i*)(p + j), v);
+            j += 16;
+            continue;
+        }
+        for (int l = 0; l < 16; l++) {
+            if (!del[p[k + l]])
+                p[j++] = p[k + l];
+        }
+    }
+#endif
+
+    for (; k < n; k++) {
+        if (!del[p[k]])
+            p[j++] = p[k];
+    }
+    return j;
+}
+
+/*
+ * grep [-vcF] PATTERN [file]
+ *
+ * fixed strings only: a pattern with anything a regex would
+ * take for special (without -F), more than one file or any
+ * other option leaves it to the real grep. the whole block is
+ * searched with memmem() instead of going line by line, the
+ * line of a hit is only looked for around it
+ * */
+
+int grep_open(Command* cmd, Filter** f)
+{
+    int invert = 0, count = 0, fixed = 0;
+    int i = 1;
+
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        if (strcmp(cmd->args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* c = cmd->args[i] + 1; *c; c++) {
+            if (*c == 'v')
+                invert = 1;
+            else if (*c == 'c')
+                count = 1;
+            else if (*c == 'F')
+                fixed = 1;
+            else
+                return -1;
+        }
+    }
+
+    char* pat = cmd->args[i];
+    if (pat == NULL || *pat == '\0' || (cmd->args[i+1] && cmd->args[i+2]))
+        return -1;
+    if (!fixed && strpbrk(pat, "\\.[]*^$+?(){}|") != NULL)
+        return -1;
+    if (f == NULL)
+        return cmd->args[i+1] != NULL;
+
+    GrepF* g = (GrepF*)filter_new(sizeof(GrepF), grep_push, grep_finish);
+    g->f.files = cmd->args[i+1] ? cmd->args + i + 1 : NULL;
+    g->pat = pat;
+    g->len = strlen(pat);
+    g->invert = invert;
+    g->count = count;
+    g->f.split = !count;
+    *f = &g->f;
+    return 0;
+}
+
+int grep_push(Filter* f, char* p, size_t len)
+{
+    GrepF* g = (GrepF*)f;
+    char* end = p + len;
+
+    // from is where the lines not looked at yet start
+    for (char* from = p; from < end && !f->out.done; ) {
+        char* hit = (char*)memmem(from, end - from, g->pat, g->len);
+        char* bol = end;
+        char* eol = end;
+        if (hit != NULL) {
+            bol = (char*)memrchr(from, '\n', hit - from);
+            bol = bol ? bol + 1 : from;
+            eol = (char*)memchr(hit, '\n', end - hit) + 1;
+        }
+
+        if (g->invert && g->count) {
+            for (char* nl = from; (nl = (char*)memchr(nl, '\n', bol - nl)) != NULL; nl++)
+                g->n++;
+        } else if (g->invert && bol > from) {
+            out_put(&f->out, from, bol - from);
+            g->n++;
+        } else if (!g->invert && hit != NULL) {
+            if (!g->count)
+                out_put(&f->out, bol, eol - bol);
+            g->n++;
+        }
+        from = eol;
+    }
+    return f->out.done;
+}
+
+int grep_finish(Filter* f)
+{
+    GrepF* g = (GrepF*)f;
+
+    if (g->count) {
+        char num[32];
+        int w = snprintf(num, sizeof(num), "%llu\n", g->n);
+        out_put(&f->out, num, w);
+    }
+    out_drain(&f->out, 1);
+    return g->n > 0 ? 0 : 1;
+}
+
+/*
+ * head [-n N | -N] [file]
+ *
+ * the first N lines, 10 without -n. once it has them it says
+ * it has had enough, and the stages in front of it stop (see
+ * stage_run()). a last line without its newline is passed on
+ * as it came. -c, more files or anything else we don't know is
+ * the real head's
+ * */
+
+int head_open(Command* cmd, Filter** f)
+{
+    long long lines = 10;
+    int i = 1;
+
+    for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != '\0'; i++) {
+        char* opt = cmd->args[i];
+        char* num;
+        char* end;
+
+        if (strcmp(opt, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-n") == 0 && cmd->args[i+1] != NULL)
+            num = cmd->args[++i];
+        else if (strncmp(opt, "-n", 2) == 0)
+            num = opt + 2;
+        else
+            num = opt + 1;
+        if (*num < '0' || *num > '9')
+            return -1;
+        lines = strtoll(num, &end, 10);
+        if (*end != '\0')
+            return -1;
+    }
+    if (cmd->args[i] != NULL && cmd->args[i+1] != NULL)
+        return -1;
+    if (f == NULL)
+        return cmd->args[i] != NULL;
+
+    HeadF* h = (HeadF*)filter_new(sizeof(HeadF), head_push, head_finish);
+    h->f.files = cmd->args[i] ? cmd->args + i : NULL;
+    h->f.raw = 1;
+    h->left = lines;
+    *f = &h->f;
+    return 0;
+}
+
+int head_push(Filter* f, char* p, size_t len)
+{
+    HeadF* h = (HeadF*)f;
+    char* end = p + len;
+    char* q = p;
+
+    // raw, so a line may go on in the next block
+    while (h->left > 0 && q < end) {
+        char* nl = (char*)memchr(q, '\n', end - q);
+        if (nl == NULL) {
+            q = end;
+            break;
+        }
+        q = nl + 1;
+        h->left--;
+    }
+    out_put(&f->out, p, q - p);
+    return h->left == 0;
+}
+
+int head_finish(Filter* f)
+{
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+/*
+ * lines N[,M] file      lines N to M (or to the end with "N,"), sed -n 'N,Mp'
+ * lines -t N file       the last N lines, tail -n N
+ * lines -p I/W file     the I-th of W parts with the same number of lines
+ * lines -c file         how many lines there are
+ *
+ * all of them go through an index of where every 1024th line
+ * starts, so they only ever look at the lines they print (and
+ * up to 1023 before them). the index is built once with a
+ * vectorized newline count and kept next to the file, as
+ * .NAME.nshidx, for as long as the file's inode, size and
+ * mtime stay the same. a last line without its newline counts
+ * as a line
+ * */
+
+int lines_open(Command* cmd, Filter** f)
+{
+    unsigned long long a = 0, b = 0;
+    char* end = NULL;
+    char* arg = cmd->args[1];
+    int mode = 'n';
+    int i = 2;
+
+    if (f == NULL)
+        return 1;   // always ours, it has no real program to fall back on
+
+    if (arg != NULL && strcmp(arg, "-c") == 0) {
+        mode = 'c';
+        end = "";
+    } else if (arg != NULL && (strcmp(arg, "-t") == 0 || strcmp(arg, "-p") == 0)
+               && cmd->args[2] != NULL) {
+        mode = arg[1];
+        a = strtoull(cmd->args[2], &end, 10);
+        if (mode == 'p') {
+            if (*end == '/')
+                b = strtoull(end + 1, &end, 10);
+            if (a < 1 || b < a)
+                end = NULL;
+        }
+        i = 3;
+    } else if (arg != NULL && arg[0] >= '0' && arg[0] <= '9') {
+        a = b = strtoull(arg, &end, 10);
+        if (*end == ',' && end[1] == '\0') {
+            b = ULLONG_MAX;
+            end++;
+        } else if (*end == ',') {
+            b = strtoull(end + 1, &end, 10);
+        }
+        if (a < 1 || b < a)
+            end = NULL;
+    }
+    if (end == NULL || *end != '\0' || cmd->args[i] == NULL || cmd->args[i+1] != NULL) {
+        fprintf(stderr, "nsh: lines usage: lines N[,M] | -t N | -p I/W | -c file\n");
+        return 2;
+    }
+
+    LinesF* l = (LinesF*)filter_new(sizeof(LinesF), lines_push, lines_finish);
+    l->f.source = 1;
+    l->path = cmd->args[i];
+    l->mode = mode;
+    l->a = a;
+    l->b = b;
+    *f = &l->f;
+    return 0;
+}
+
+int lines_push(Filter* f, char* p, size_t n)
+{
+    (void)f;
+    (void)p;
+    (void)n;
+    return 1;   // it reads nothing
+}
+
+int lines_finish(Filter* f)
+{
+    LinesF* l = (LinesF*)f;
+    struct stat sb;
+    LineIdx x;
+
+    int fd = open(l->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "nsh: lines: %s: %s\n", l->path, strerror(errno));
+        return 2;
+    }
+    size_t size = sb.st_size;
+    char* map = NULL;
+    if (size > 0) {
+        // writable, the stage after us may change what it gets in place
+        map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "nsh: lines: %s: %s\n", l->path, strerror(errno));
+            return 2;
+        }
+    }
+    lidx_load(&x, l->path, &sb, map);
+
+    unsigned long long total = x.head.lines + (size > 0 && map[size-1] != '\n');
+    unsigned long long a = l->a, b = l->b;
+    switch (l->mode) {
+    case 'c': {
+        char num[32];
+        int w = snprintf(num, sizeof(num), "%llu\n", total);
+        out_put(&f->out, num, w);
+        a = b = 0;
+        break;
+    }
+    case 't':
+        b = total;
+        a = total > l->a ? total - l->a + 1 : 1;
+        break;
+    case 'p':
+        // the first total % W parts get one line more
+        a = (l->a - 1) * (total / l->b) + (l->a - 1 < total % l->b ? l->a - 1 : total % l->b) + 1;
+        b = a - 1 + total / l->b + (l->a - 1 < total % l->b);
+        break;
+    }
+
+    if (a >= 1 && a <= b && a <= total) {
+        size_t beg = lidx_line(&x, map, size, a);
+        size_t end = lidx_line(&x, map, size, b < total ? b + 1 : total + 1);
+        // a last line without its newline apart, so the rest can go on without a copy
+        size_t whole = end;
+        if (end == size && map[size-1] != '\n') {
+            char* nl = (char*)memrchr(map + beg, '\n', end - beg);
+            whole = nl ? (size_t)(nl + 1 - map) : beg;
+        }
+        out_put(&f->out, map + beg, whole - beg);
+        out_put(&f->out, map + whole, end - whole);
+    }
+    out_drain(&f->out, 1);
+    return 0;
+}
+
+/* the cached index if it is still good, otherwise a new one,
+ * saved for next time when the file is big enough to bother */
+
+void lidx_load(LineIdx* x, char* path, struct stat* sb, const char* map)
+{
+    char cache[4096];
+    char* slash = strrchr(path, '/');
+    if (slash)
+        snprintf(cache, sizeof(cache), "%.*s/.%s.nshidx", (int)(slash - path), path, slash + 1);
+    else
+        snprintf(cache, sizeof(cache), ".%s.nshidx", path);
+
+    memset(&x->head, 0, sizeof(x->head));
+    memcpy(x->head.magic, "nshlidx1", 8);
+    x->head.dev = sb->st_dev;
+    x->head.ino = sb->st_ino;
+    x->head.size = sb->st_size;
+    x->head.mtime = sb->st_mtim.tv_sec;
+    x->head.mtime_ns = sb->st_mtim.tv_nsec;
+    x->head.step = LIDX_STEP;
+
+    int fd = open(cache, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        LineIdxHead h;
+        if (read(fd, &h, sizeof(h)) == sizeof(h)
+            && memcmp(&h, &x->head, offsetof(LineIdxHead, lines)) == 0 && h.step == LIDX_STEP
+            && h.lines <= h.size && h.num == lidx_num(h.lines, map, h.size)) {
+            unsigned long long* offs = (unsigned long long*)malloc(h.num * sizeof(unsigned long long));
+            ssize_t want = h.num * sizeof(unsigned long long);
+            if (offs && read(fd, offs, want) == want && lidx_check(offs, h.num, map, h.size)) {
+                x->head = h;
+                x->offs = offs;
+                close(fd);
+                return;
+            }
+            free(offs);
+        }
+        close(fd);
+    }
+
+    lidx_build(x, map, sb->st_size);
+    if ((size_t)sb->st_size < LIDX_CACHE_MIN)
+        return;
+
+    // a whole one or none: written aside, then renamed over the old one
+    char tmp[4096 + 16];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+    fd = mkstemp(tmp);
+    if (fd == -1)
+        return;   // not our directory, it does without
+    size_t len = x->head.num * sizeof(unsigned long long);
+    fchmod(fd, 0644);   // others slicing the same file can use it too
+    if (write(fd, &x->head, sizeof(x->head)) != sizeof(x->head)
+        || write(fd, x->offs, len) != (ssize_t)len || rename(tmp, cache) == -1)
+        unlink(tmp);
+    close(fd);
+}
+
+/* how many offsets an index of a file with that many newlines
+ * has: one for line 1, one per step, but none for the end of
+ * the file when the last newline falls on a step */
+
+unsigned long long lidx_num(unsigned long long lines, const char* map, size_t size)
+{
+    unsigned long long num = lines / LIDX_STEP + 1;
+    if (lines > 0 && lines % LIDX_STEP == 0 && map[size-1] == '\n')
+        num--;
+    return num;
+}
+
+/* the cache is a file anyone could have written: every offset
+ * has to be in the file, after the one before it and right
+ * after a newline, or lidx_line() would go out of the mapping */
+
+int lidx_check(const unsigned long long* offs, unsigned long long num, const char* map, size_t size)
+{
+    if (offs[0] != 0)
+        return 0;
+    for (unsigned long long k = 1; k < num; k++) {
+        if (offs[k] <= offs[k-1] || offs[k] >= size || map[offs[k] - 1] != '\n')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * counts the newlines a vector at a time: compare, movemask,
+ * popcount. only when a vector takes the count past the next
+ * multiple of the step are its bits gone through one by one,
+ * to find where that line starts
+ * */
+
+void lidx_build(LineIdx* x, const char* p, size_t n)
+{
+    unsigned long long lines = 0;
+    unsigned long long next = LIDX_STEP;
+    size_t cap = n / 4096 / LIDX_STEP * 64 + 16;   // a guess, lines of ~64 bytes
+    size_t i = 0;
+
+    x->offs = (unsigned long long*)malloc(cap * sizeof(unsigned long long));
+    x->offs[0] = 0;
+    x->head.num = 1;
+
+    #define LIDX_ADD(off) do { \
+        if (x->head.num == cap) { \
+            cap *= 2; \
+            x->offs = (unsigned long long*)realloc(x->offs, cap * sizeof(unsigned long long)); \
+        } \
+        if ((off) < n) \
+            x->offs[x->head.num++] = (off); \
+        next += LIDX_STEP; \
+    } while (0)
+
+#if defined(__AVX2__)
+    __m256i v_nl = _mm256_set1_epi8('\n');
+    for (; i + 32 <= n; i += 32) {
+        unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), v_nl));
+#elif defined(__SSE2__)
+    __m128i v_nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), v_nl));
+#else
+    for (; i + 32 <= n; i += 32) {
+        unsigned int m = 0;
+        for (int k = 0; k < 32; k++)
+            m |= (unsigned int)(p[i + k] == '\n') << k;
+#endif
+        int c = __builtin_popcount(m);
+        if (lines + c < next) {
+            lines += c;
+            continue;
+        }
+        for (; m; m &= m - 1) {
+            if (++lines == next)
+                LIDX_ADD(i + __builtin_ctz(m) + 1);
+        }
+    }
+    for (; i < n; i++) {
+        if (p[i] == '\n' && ++lines == next)
+            LIDX_ADD(i + 1);
+    }
+    #undef LIDX_ADD
+
+    x->head.lines = lines;
+}
+
+/* where line (from 1) starts, size for the one after the last */
+
+size_t lidx_line(LineIdx* x, const char* map, size_t size, unsigned long long line)
+{
+    unsigned long long s = (line - 1) / LIDX_STEP;
+    if (s >= x->head.num)
+        return size;
+
+    size_t off = x->offs[s];
+    for (unsigned long long k = s * LIDX_STEP + 1; k < line; k++) {
+        const char* nl = (const char*)memchr(map + off, '\n', size - off);
+        if (nl == NULL)
+            return size;
+        off = nl + 1 - map;
+    }
+    return off;
+}
+
+/*
+ * seq [FIRST [INCR]] LAST
+ *
+ * integers only, one per line. they are formatted into a big
+ * buffer and go out in blocks of SEQ_BLOCK, fused with the next
+ * stage without a pipe, or in big writes to fd 1. counting up
+ * by one, the common case, doesn't format at all: the number is
+ * kept as text and its digits incremented in place. options,
+ * fractions and the like are the real seq's
+ * */
+
+int seq_open(Command* cmd, Filter** f)
+{
+    long long v[3];
+    int n = 0;
+
+    for (int i = 1; cmd->args[i] != NULL; i++) {
+        char* a = cmd->args[i];
+        char* end;
+        if (n == 3 || (a[0] == '-' && (a[1] < '0' || a[1] > '9')))
+            return -1;
+        errno = 0;
+        v[n++] = strtoll(a, &end, 10);
+        if (end == a || *end != '\0' || errno != 0)
+            return -1;
+    }
+    if (n == 0 || (n == 3 && v[1] == 0))
+        return -1;
+    if (f == NULL)
+        return 1;
+
+    SeqF* s = (SeqF*)filter_new(sizeof(SeqF), seq_push, seq_finish);
+    s->f.source = 1;
+    s->first = n > 1 ? v[0] : 1;
+    s->incr = n > 2 ? v[1] : 1;
+    s->last = v[n-1];
+    *f = &s->f;
+    return 0;
+}
+
+int seq_push(Filter* f, char* p, size_t n)
+{
+    (void)f;
+    (void)p;
+    (void)n;
+    return 1;   // it reads nothing
+}
+
+int seq_finish(Filter* f)
+{
+    SeqF* s = (SeqF*)f;
+    unsigned long long left = 0;   // numbers to go, worked out up front so nothing overflows
+    if (s->incr > 0 && s->first <= s->last)
+        left = ((unsigned long long)s->last - s->first) / s->incr + 1;
+    else if (s->incr < 0 && s->first >= s->last)
+        left = ((unsigned long long)s->first - s->last) / (0 - (unsigned long long)s->incr) + 1;
+
+    char* buf = (char*)malloc(SEQ_BLOCK + 256);
+    long long cur = s->first;
+    char d[32];
+    int len = fmt_num(d, cur);
+
+    while (left > 0 && !f->out.done) {
+        char* q = buf;
+        if (s->incr == 1 && cur >= 0) {
+            while (left > 0 && q < buf + SEQ_BLOCK) {
+                if (d[len-1] == '0' && left >= 10) {
+                    // a whole ten: only the last digit changes
+                    for (int k = 0; k < 10; k++) {
+                        memcpy(q, d, 24);
+                        q[len-1] = '0' + k;
+                        q[len] = '\n';
+                        q += len + 1;
+                    }
+                    left -= 10;
+                    d[len-1] = '9';
+                } else {
+                    memcpy(q, d, 24);
+                    q[len] = '\n';
+                    q += len + 1;
+                    left--;
+                }
+                int i = len - 1;
+                while (i >= 0 && d[i] == '9')
+                    d[i--] = '0';
+                if (i >= 0) {
+                    d[i]++;
+                } else {
+                    d[0] = '1';   // 99 -> 100
+                    d[len++] = '0';
+                }
+            }
+        } else {
+            while (left > 0 && q < buf + SEQ_BLOCK) {
+                q += fmt_num(q, cur);
+                *q++ = '\n';
+                if (--left > 0)
+                    cur += s->incr;
+            }
+        }
+        out_put(&f->out, buf, q - buf);
+    }
+    out_drain(&f->out, 1);
+    free(buf);
+    return 0;
+}
+
+/* v in decimal at p, two digits per step out of a table.
+ * returns the length, 20 bytes at most */
+
+int fmt_num(char* p, long long v)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char tmp[24];
+    char* q = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? 0 - (unsigned long long)v : (unsigned long long)v;
+
+    while (u >= 100) {
+        unsigned int r = u % 100;
+        u /= 100;
+        q -= 2;
+        memcpy(q, pairs + 2 * r, 2);
+    }
+    if (u >= 10) {
+        q -= 2;
+        memcpy(q, pairs + 2 * u, 2);
+    } else {
+        *--q = '0' + u;
+    }
+    if (v < 0)
+        *--q = '-';
+
+    int len = tmp + sizeof(tmp) - q;
+    memcpy(p, q, len);
+    return len;
+}
+
+/*
+ * stats prints the latency percentiles of every command
+ * run so far, the ones that took the most wall time in
+ * total first. 'stats reset' forgets everything
+ * */
+
+int cmp_stats_wall(const void* a, const void* b)
+{
+    const CmdStats* x = *(CmdStats* const*)a;
+    const CmdStats* y = *(CmdStats* const*)b;
+    if (x->wall.sum != y->wall.sum)
+        return x->wall.sum < y->wall.sum ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+int sh_stats(Command* cmd)
+{
+    if (cmd->args[1] != NULL && strcmp(cmd->args[1], "reset") == 0) {
+        for (unsigned int i = 0; i < stat_cap; i++) {
+            if (stat_tab[i].st) {
+                free(stat_tab[i].st->name);
+                free(stat_tab[i].st);
+            }
+        }
+        free(stat_tab);
+        stat_tab = NULL;
+        stat_cap = stat_len = 0;
+        return 1;
+    }
+
+    CmdStats** all = (CmdStats**)malloc((stat_len + 1) * sizeof(CmdStats*));
+    int n = 0;
+    for (unsigned int i = 0; i < stat_cap; i++) {
+        if (stat_tab[i].st)
+            all[n++] = stat_tab[i].st;
+    }
+    qsort(all, n, sizeof(CmdStats*), cmp_stats_wall);
+
+    printf("%-16s %8s %9s  %-6s %9s %9s %9s %9s\n",
+           "command", "runs", "total", "", "p50", "p90", "p99", "max");
+    for (int i = 0; i < n; i++) {
+        char tot[16];
+        fmt_us(tot, sizeof(tot), all[i]->wall.sum);
+        Hist* h[3] = { &all[i]->spawn, &all[i]->wall, &all[i]->cpu };
+        char* label[3] = { "spawn", "wall", "cpu" };
+        for (int k = 0; k < 3; k++) {
+            char p[4][16];
+            fmt_us(p[0], 16, hist_pct(h[k], 0.50));
+            fmt_us(p[1], 16, hist_pct(h[k], 0.90));
+            fmt_us(p[2], 16, hist_pct(h[k], 0.99));
+            fmt_us(p[3], 16, h[k]->max);
+            if (k == 0)
+                printf("%-16s %8llu %9s  ", all[i]->name, all[i]->spawn.n, tot);
+            else
+                printf("%-16s %8s %9s  ", "", "", "");
+            printf("%-6s %9s %9s %9s %9s\n", label[k], p[0], p[1], p[2], p[3]);
+        }
+    }
+
+    free(all);
+    return 1;
+}
+
+void hist_add(Hist* h, unsigned long long v)
+{
+    int idx;
+    if (v >= 1ULL << HIST_MAX_BITS)
+        v = (1ULL << HIST_MAX_BITS) - 1;
+
+    if (v < 2 * HIST_SUB) {
+        idx = (int)v;
+    } else {
+        int e = 63 - __builtin_clzll(v);
+        idx = (e - HIST_SUB_BITS + 1) * HIST_SUB
+              + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    }
+
+    h->counts[idx]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* the value below which a fraction p of the samples lie,
+ * rounded up to the end of its bucket */
+
+unsigned long long hist_pct(Hist* h, double p)
+{
+    unsigned long long want = (unsigned long long)(p * h->n + 0.5);
+    unsigned long long seen = 0;
+
+    if (h->n == 0)
+        return 0;
+    if (want == 0)
+        want = 1;
+
+    for (int idx = 0; idx < HIST_BUCKETS; idx++) {
+        seen += h->counts[idx];
+        if (seen < want)
+            continue;
+        unsigned long long hi = idx + 1 < HIST_BUCKETS ? hist_lo(idx + 1) - 1 : h->max;
+        return hi < h->max ? hi : h->max;
+    }
+    return h->max;
+}
+
+/* smallest value that lands in bucket idx */
+
+unsigned long long hist_lo(int idx)
+{
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    int e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    return (unsigned long long)(HIST_SUB + idx % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/*
+ * stats_get() finds the entry for a command, keyed by the
+ * basename of argv[0], creating it on first use.
+ * the table is open addressing with linear probing, its
+ * size is a power of two and it never gets over 3/4 full
+ * */
+
+CmdStats* stats_get(char* argv0)
+{
+    char* name = strrchr(argv0, '/');
+    name = name ? name + 1 : argv0;
+
+    unsigned int hash = hash_str(name);
+
+    if (4 * (stat_len + 1) > 3 * stat_cap) {
+        unsigned int ncap = stat_cap ? stat_cap * 2 : 64;
+        StatSlot* ntab = (StatSlot*)calloc(ncap, sizeof(StatSlot));
+        if (!ntab) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int i = 0; i < stat_cap; i++) {
+            if (!stat_tab[i].st)
+                continue;
+            unsigned int j = stat_tab[i].hash & (ncap - 1);
+            while (ntab[j].st)
+                j = (j + 1) & (ncap - 1);
+            ntab[j] = stat_tab[i];
+        }
+        free(stat_tab);
+        stat_tab = ntab;
+        stat_cap = ncap;
+    }
+
+    unsigned int j = hash & (stat_cap - 1);
+    while (stat_tab[j].st) {
+        if (stat_tab[j].hash == hash && strcmp(stat_tab[j].st->name, name) == 0)
+            return stat_tab[j].st;
+        j = (j + 1) & (stat_cap - 1);
+    }
+
+    CmdStats* st = (CmdStats*)calloc(1, sizeof(CmdStats));
+    if (!st || !(st->name = strdup(name))) {
+        fprintf(stderr, "nsh: malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    stat_tab[j].hash = hash;
+    stat_tab[j].st = st;
+    stat_len++;
+    return st;
+}
+
+// fnv-1a
+
+unsigned int hash_str(const char* s)
+{
+    unsigned int hash = 2166136261u;
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+void fmt_us(char* buf, size_t n, unsigned long long us)
+{
+    if (us < 10000)
+        snprintf(buf, n, "%lluus", us);
+    else if (us < 10000000)
+        snprintf(buf, n, "%.1fms", us / 1e3);
+    else
+        snprintf(buf, n, "%.2fs", us / 1e6);
+}
+
+/*
+ * the event loop. fds are registered with a callback and
+ * dispatched from one epoll instance. timers live in a
+ * min-heap and a single timerfd is armed for the earliest
+ * deadline, so they are just one more fd to the loop
+ * */
+
+void ev_init(void)
+{
+    sigset_t mask;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("nsh");
+        exit(EXIT_FAILURE);
+    }
+
+    /* children get the original mask back before exec */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &child_mask);
+    sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    /* a Task writing to a pipe nobody reads anymore gets EPIPE,
+     * that mustn't kill the shell. it never gets delivered, the
+     * children don't inherit pending signals */
+    sigset_t pipe_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, NULL);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (sig_fd == -1 || timer_fd == -1) {
+        perror("nsh");
+        exit(EXIT_FAILURE);
+    }
+    ev_add(sig_fd, EPOLLIN, on_sigchld, NULL);
+    ev_add(timer_fd, EPOLLIN, on_timerfd, NULL);
+}
+
+int ev_add(int fd, unsigned int events, EvFunc func, void* ctx)
+{
+    struct epoll_event ev;
+
+    if (fd >= ev_cap) {
+        int ncap = ev_cap ? ev_cap : 64;
+        while (ncap <= fd)
+            ncap *= 2;
+        ev_watches = (EvWatch*)realloc(ev_watches, ncap * sizeof(EvWatch));
+        if (!ev_watches) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(ev_watches + ev_cap, 0, (ncap - ev_cap) * sizeof(EvWatch));
+        ev_cap = ncap;
+    }
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+    ev_watches[fd].func = func;
+    ev_watches[fd].ctx = ctx;
+    return 0;
+}
+
+void ev_del(int fd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    if (fd < ev_cap)
+        ev_watches[fd].func = NULL;
+}
+
+/* one round of the loop: wait (or just look, if !block)
+ * for ready fds and call their callbacks */
+
+void ev_run(int block)
+{
+    struct epoll_event evs[16];
+    int n = epoll_wait(epfd, evs, 16, block ? -1 : 0);
+
+    for (int i = 0; i < n; i++) {
+        int fd = evs[i].data.fd;
+        if (fd < ev_cap && ev_watches[fd].func)
+            ev_watches[fd].func(fd, evs[i].events, ev_watches[fd].ctx);
+    }
+}
+
+/* call func(ctx) once, delay_ns from now. returns an
+ * id that ev_timer_cancel() takes */
+
+int ev_timer(long long delay_ns, TimerFunc func, void* ctx)
+{
+    if (num_timers == cap_timers) {
+        cap_timers = cap_timers ? cap_timers * 2 : 16;
+        timers = (Timer*)realloc(timers, cap_timers * sizeof(Timer));
+        if (!timers) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Timer t;
+    t.when = now_ns() + delay_ns;
+    t.id = ++timer_ids;
+    t.func = func;
+    t.ctx = ctx;
+
+    // sift up
+    int i = num_timers++;
+    while (i > 0 && timers[(i - 1) / 2].when > t.when) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i] = t;
+
+    if (i == 0)
+        timer_arm();
+    return t.id;
+}
+
+/* take timers[i] out of the heap */
+
+void timer_remove(int i)
+{
+    Timer t = timers[--num_timers];
+    if (i == num_timers)
+        return;
+
+    // the last one goes into the hole, up or down from there
+    while (i > 0 && timers[(i - 1) / 2].when > t.when) {
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= num_timers)
+            break;
+        if (c + 1 < num_timers && timers[c + 1].when < timers[c].when)
+            c++;
+        if (timers[c].when >= t.when)
+            break;
+        timers[i] = timers[c];
+        i = c;
+    }
+    timers[i] = t;
+}
+
+void ev_timer_cancel(int id)
+{
+    for (int i = 0; i < num_timers; i++) {
+        if (timers[i].id == id) {
+            timer_remove(i);
+            if (i == 0)
+                timer_arm();
+            return;
+        }
+    }
+}
+
+void timer_arm(void)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (num_timers > 0) {
+        its.it_value.tv_sec = timers[0].when / 1000000000LL;
+        its.it_value.tv_nsec = timers[0].when % 1000000000LL;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void on_timerfd(int fd, unsigned int events, void* ctx)
+{
+    unsigned long long expired;
+    (void)events;
+    (void)ctx;
+
+    read(fd, &expired, sizeof(expired));
+
+    long long now = now_ns();
+    while (num_timers > 0 && timers[0].when <= now) {
+        Timer t = timers[0];
+        timer_remove(0);
+        t.func(t.ctx);
+    }
+    timer_arm();
+}
+
+/*
+ * metrics in the prometheus text format. with -m they are
+ * written to a file every metrics_ival seconds (for the
+ * node exporter textfile collector, so it goes through a
+ * rename to never be seen half written), with -M they are
+ * served to anyone who connects to the unix socket, e.g.
+ * curl --unix-socket nsh.sock http://localhost/metrics
+ * */
+
+int metrics_init(void)
+{
+    if (metrics_file)
+        ev_timer(metrics_ival * 1000000000LL, metrics_tick, NULL);
+
+    if (metrics_sock) {
+        struct sockaddr_un addr;
+        int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(metrics_sock) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "nsh: socket path too long\n");
+            return -1;
+        }
+        strcpy(addr.sun_path, metrics_sock);
+        unlink(metrics_sock);
+
+        if (lfd == -1 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+            || listen(lfd, 16) == -1) {
+            perror("nsh");
+            return -1;
+        }
+        ev_add(lfd, EPOLLIN, on_metrics_accept, NULL);
+    }
+    return 0;
+}
+
+char* metrics_format(size_t* len)
+{
+    char* buf = NULL;
+    FILE* f = open_memstream(&buf, len);
+
+    fprintf(f, "# HELP nsh_commands_total Pipelines started.\n"
+               "# TYPE nsh_commands_total counter\n"
+               "nsh_commands_total %llu\n", n_commands);
+    fprintf(f, "# HELP nsh_forks_total Child processes forked.\n"
+               "# TYPE nsh_forks_total counter\n"
+               "nsh_forks_total %llu\n", n_forks);
+    fprintf(f, "# HELP nsh_reaped_total Child processes reaped.\n"
+               "# TYPE nsh_reaped_total counter\n"
+               "nsh_reaped_total %llu\n", n_reaped);
+    fprintf(f, "# HELP nsh_jobs_running Pipelines with children still running.\n"
+               "# TYPE nsh_jobs_running gauge\n"
+               "nsh_jobs_running %d\n", num_jobs);
+    fprintf(f, "# HELP nsh_children_running Child processes not reaped yet.\n"
+               "# TYPE nsh_children_running gauge\n"
+               "nsh_children_running %d\n", num_procs);
+    fprintf(f, "# HELP nsh_jobs_queued Background jobs waiting for the pool.\n"
+               "# TYPE nsh_jobs_queued gauge\n"
+               "nsh_jobs_queued %d\n", pool_queued);
+    fprintf(f, "# HELP nsh_pool_limit Background jobs allowed to run at once, 0 if unlimited.\n"
+               "# TYPE nsh_pool_limit gauge\n"
+               "nsh_pool_limit %d\n", pool_mode == POOL_OFF ? 0 : pool_limit);
+    fprintf(f, "# HELP nsh_path_cache_hits_total Command lookups answered from the path cache.\n"
+               "# TYPE nsh_path_cache_hits_total counter\n"
+               "nsh_path_cache_hits_total %llu\n", path_hits);
+    fprintf(f, "# HELP nsh_path_cache_misses_total Command lookups that had to search PATH.\n"
+               "# TYPE nsh_path_cache_misses_total counter\n"
+               "nsh_path_cache_misses_total %llu\n", path_misses);
+
+    /* the powers of two are bucket boundaries of the
+     * histogram, so these cumulative counts are exact. they
+     * are of the samples below 2^k us, whole microseconds:
+     * le, which includes its bound, is 2^k - 1 */
+    fprintf(f, "# HELP nsh_spawn_latency_seconds Time spent in fork().\n"
+               "# TYPE nsh_spawn_latency_seconds histogram\n");
+    int idx = 0;
+    unsigned long long seen = 0;
+    for (int k = 3; k <= 24; k++) {
+        while (idx < HIST_BUCKETS && hist_lo(idx) < (1ULL << k))
+            seen += spawn_hist.counts[idx++];
+        fprintf(f, "nsh_spawn_latency_seconds_bucket{le=\"%g\"} %llu\n",
+                (double)((1ULL << k) - 1) / 1e6, seen);
+    }
+    fprintf(f, "nsh_spawn_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+               "nsh_spawn_latency_seconds_sum %g\n"
+               "nsh_spawn_latency_seconds_count %llu\n",
+            spawn_hist.n, spawn_hist.sum / 1e6, spawn_hist.n);
+
+    fclose(f);
+    return buf;
+}
+
+void metrics_tick(void* ctx)
+{
+    metrics_write_file();
+    ev_timer(metrics_ival * 1000000000LL, metrics_tick, ctx);
+}
+
+void metrics_write_file(void)
+{
+    size_t len;
+    char* buf = metrics_format(&len);
+    char* tmp = (char*)malloc(strlen(metrics_file) + 5);
+
+    sprintf(tmp, "%s.tmp", metrics_file);
+    int mfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mfd == -1 || write(mfd, buf, len) != (ssize_t)len) {
+        perror("nsh: metrics");
+        if (mfd != -1)
+            close(mfd);
+        unlink(tmp);
+    } else {
+        close(mfd);
+        rename(tmp, metrics_file);
+    }
+    free(tmp);
+    free(buf);
+}
+
+void on_metrics_accept(int fd, unsigned int events, void* ctx)
+{
+    int cfd;
+    (void)events;
+    (void)ctx;
+
+    // a client that never sends anything doesn't get to keep the fd
+    while ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+        int id = ev_timer(METRICS_IDLE * 1000000000LL, metrics_idle, (void*)(intptr_t)cfd);
+        ev_add(cfd, EPOLLIN, on_metrics_conn, (void*)(intptr_t)id);
+    }
+}
+
+void metrics_idle(void* ctx)
+{
+    int fd = (int)(intptr_t)ctx;
+    ev_del(fd);
+    close(fd);
+}
+
+/* whatever the request was, the answer is the metrics.
+ * one answer per connection, it is closed after it */
+
+void on_metrics_conn(int fd, unsigned int events, void* ctx)
+{
+    char req[4096];
+    size_t len;
+    (void)events;
+
+    ev_timer_cancel((int)(intptr_t)ctx);
+
+    if (read(fd, req, sizeof(req)) > 0) {
+        char* body = metrics_format(&len);
+        char hdr[128];
+        int n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+        send(fd, hdr, n, MSG_NOSIGNAL | MSG_MORE);
+        send(fd, body, len, MSG_NOSIGNAL);
+        free(body);
+    }
+    ev_del(fd);
+    close(fd);
+}
+
+/*
+ * the json log: one line per pipeline, written when the job is
+ * done. a stage that never started has a null pid, status is
+ * what a shell would put in $? (128+n for a signal)
+ *
+ * {"ts":1528000000.123,"job":3,"cwd":"/home/n","bg":false,
+ *  "in":null,"out":"x.txt","append":false,"status":0,"wall":0.004,
+ *  "stages":[{"argv":["ls","-l"],"pid":4242,"status":0,"signal":null,
+ *             "wall":0.003,"utime":0.001,"stime":0.001,"maxrss_kb":2816}]}
+ * */
+
+void jlog_job(Job* job)
+{
+    FullCommand* cmd = job->cmd;
+    double end = 0;
+
+    if (jlog_len >= JLOG_MAX) {
+        jlog_dropped++;
+        return;
+    }
+
+    jlog_printf("{\"ts\":%lld.%03ld,\"job\":%d,\"cwd\":",
+                (long long)job->t_real.tv_sec, job->t_real.tv_nsec / 1000000, job->id);
+    jlog_str(job->cwd);
+    jlog_printf(",\"bg\":%s,\"in\":", job->bg ? "true" : "false");
+    jlog_str(cmd->file_in);
+    jlog_printf(",\"out\":");
+    jlog_str(cmd->file_out);
+    jlog_printf(",\"append\":%s,\"stages\":[",
+                cmd->file_out && !cmd->overwrite ? "true" : "false");
+
+    for (int i = 0; i < cmd->num_cmds; i++) {
+        StageRun* run = &job->runs[i];
+
+        jlog_printf("%s{\"argv\":[", i ? "," : "");
+        for (int a = 0; cmd->cmds[i].args[a] != NULL; a++) {
+            jlog_printf(a ? "," : "");
+            jlog_str(cmd->cmds[i].args[a]);
+        }
+        if (run->pid == 0) {
+            jlog_printf("],\"pid\":null}");
+            continue;
+        }
+
+        int st = WIFSIGNALED(run->status) ? 128 + WTERMSIG(run->status) : WEXITSTATUS(run->status);
+        jlog_printf("],\"pid\":%d,\"status\":%d,\"signal\":", run->pid, st);
+        if (WIFSIGNALED(run->status))
+            jlog_printf("%d", WTERMSIG(run->status));
+        else
+            jlog_printf("null");
+        jlog_printf(",\"wall\":%.6f,\"utime\":%.6f,\"stime\":%.6f,\"maxrss_kb\":%ld}",
+                    (run->t_end - run->t_spawn) / 1e9,
+                    run->ru.ru_utime.tv_sec + run->ru.ru_utime.tv_usec / 1e6,
+                    run->ru.ru_stime.tv_sec + run->ru.ru_stime.tv_usec / 1e6,
+                    run->ru.ru_maxrss);
+        if (run->t_end > end)
+            end = run->t_end;
+    }
+
+    int st = WIFSIGNALED(job->status) ? 128 + WTERMSIG(job->status) : WEXITSTATUS(job->status);
+    jlog_printf("],\"status\":%d", st);
+    if (job->on_done == retry_done)
+        jlog_printf(",\"attempt\":%d", ((Retry*)job->done_ctx)->attempt);
+    jlog_printf(",\"wall\":%.6f}\n", end > 0 ? (end - job->t_start) / 1e9 : 0.0);
+
+    if (jlog_len >= 65536)
+        jlog_flush();
+    else if (jlog_timer == 0)
+        jlog_timer = ev_timer(1000000000LL, jlog_tick, NULL);
+}
+
+void jlog_printf(const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(jlog_buf + jlog_len, jlog_cap - jlog_len, fmt, ap);
+        va_end(ap);
+        if (jlog_len + n < jlog_cap)
+            break;
+        jlog_cap = jlog_cap ? jlog_cap * 2 : 131072;
+        while (jlog_cap <= jlog_len + n)
+            jlog_cap *= 2;
+        jlog_buf = (char*)realloc(jlog_buf, jlog_cap);
+        if (!jlog_buf) {
+            fprintf(stderr, "nsh: malloc error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    jlog_len += n;
+}
+
+/* a json string, or null */
+
+void jlog_str(const char* s)
+{
+    if (s == NULL) {
+        jlog_printf("null");
+        return;
+    }
+
+    jlog_printf("\"");
+    for (; *s; s++) {
+        unsigned char c = *s;
+        int n = c < 0x80 ? 1 : utf8_len((const unsigned char*)s);
+        if (c == '"' || c == '\\')
+            jlog_printf("\\%c", c);
+        else if (c < 0x20 || n == 0)
+            jlog_printf("\\u%04x", c);   // a byte that isn't utf-8 goes in as U+00XX
+        else
+            jlog_printf("%.*s", n, s);
+        if (n > 1)
+            s += n - 1;
+    }
+    jlog_printf("\"");
+}
+
+/* the length of the valid utf-8 sequence at s, 0 if it isn't one
+ * (overlong, a surrogate, past U+10FFFF or cut short) */
+
+int utf8_len(const unsigned char* s)
+{
+    int n;
+    unsigned int cp;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        n = 2;
+        cp = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        n = 3;
+        cp = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        n = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;   // the terminating \0 stops it here too
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000)
+        || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+        return 0;
+    return n;
+}
+
+/* hands what has been collected to the writer thread. if it is
+ * still busy with the last lot, the records stay here and it is
+ * tried again in a bit */
+
+void jlog_flush(void)
+{
+    if (jlog_timer) {
+        ev_timer_cancel(jlog_timer);
+        jlog_timer = 0;
+    }
+    if (jlog_len == 0)
+        return;
+
+    pthread_mutex_lock(&jlog_mu);
+    int busy = jlog_out_len > 0;
+    if (!busy) {
+        char* buf = jlog_out;
+        size_t cap = jlog_out_cap;
+        jlog_out = jlog_buf;
+        jlog_out_cap = jlog_cap;
+        jlog_out_len = jlog_len;
+        jlog_buf = buf;
+        jlog_cap = cap;
+        jlog_len = 0;
+        pthread_cond_signal(&jlog_cv);
+    }
+    pthread_mutex_unlock(&jlog_mu);
+
+    if (busy)
+        jlog_timer = ev_timer(100000000LL, jlog_tick, NULL);
+}
+
+void jlog_start(void)
+{
+    int err = pthread_create(&jlog_thread, NULL, jlog_writer, NULL);
+    if (err != 0) {
+        fprintf(stderr, "nsh: json log: %s\n", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* on the way out: the writer finishes what it has, what is
+ * left here is written after it */
+
+void jlog_close(void)
+{
+    if (jlog_timer) {
+        ev_timer_cancel(jlog_timer);
+        jlog_timer = 0;
+    }
+    pthread_mutex_lock(&jlog_mu);
+    jlog_stop = 1;
+    pthread_cond_signal(&jlog_cv);
+    pthread_mutex_unlock(&jlog_mu);
+    pthread_join(jlog_thread, NULL);
+
+    jlog_write(jlog_buf, jlog_len);
+    jlog_len = 0;
+}
+
+void* jlog_writer(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&jlog_mu);
+    for (;;) {
+        while (jlog_out_len == 0 && !jlog_stop)
+            pthread_cond_wait(&jlog_cv, &jlog_mu);
+        if (jlog_out_len == 0)
+            break;
+
+        char* p = jlog_out;
+        size_t len = jlog_out_len;
+        pthread_mutex_unlock(&jlog_mu);
+        jlog_write(p, len);
+        pthread_mutex_lock(&jlog_mu);
+        jlog_out_len = 0;
+    }
+    pthread_mutex_unlock(&jlog_mu);
+    return NULL;
+}
+
+void jlog_write(const char* p, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(jlog_fd, p + off, len - off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("nsh: json log");
+            break;
+        }
+        off += n;
+    }
+}
+
+void jlog_tick(void* ctx)
+{
+    (void)ctx;
+    jlog_timer = 0;
+    jlog_flush();
+}
+
 /* function to print out the Full Command
  * neatly for debugging */
 
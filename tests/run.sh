@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# regression tests for nsh
+#
+# each case feeds a script to a fresh shell and compares what it
+# prints with what it should print. the shell has to exit on its
+# own within LIMIT seconds. exits 1 if any case fails.
+#
+# usage: tests/run.sh [path to nsh]
+#
+# environment:
+#   LIMIT       seconds a case may take (default 5)
+#
+
+NSH=${1:-./nsh}
+LIMIT=${LIMIT:-5}
+
+if [ ! -x "$NSH" ]; then
+    echo "run: $NSH is not executable, build it first:" >&2
+    echo "    gcc -O2 -pthread -o nsh main.c" >&2
+    exit 2
+fi
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/nsh-tests.XXXXXX") || exit 2
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 2
+
+failed=0
+total=0
+
+# check name script expected: runs script (one command per line)
+# in the shell and compares its stdout with expected
+check() {
+    total=$((total + 1))
+    printf '%s\n' "$2" > script
+    printf '%s' "$3" > want
+    timeout "$LIMIT" "$NSH" < script > got 2> err
+    rc=$?
+    if [ $rc -eq 124 ]; then
+        echo "FAIL $1: the shell did not exit within ${LIMIT}s"
+        failed=$((failed + 1))
+    elif ! cmp -s want got; then
+        echo "FAIL $1:"
+        diff want got | sed 's/^/    /'
+        failed=$((failed + 1))
+    fi
+}
+
+seq 1 1000 > nums
+
+# background pipelines must not hold the shell up on quit or eof.
+# the producer would never stop, timeout only cleans it up later
+check bg-endless-quit "timeout 30 yes | grep y | cat > /dev/null &
+quit" ""
+check bg-endless-eof "timeout 30 yes | grep y | cat > /dev/null &" ""
+
+# a background pipeline still finishes after eof
+check bg-last-line "cat nums | grep 7 | wc -l > bg.out &" ""
+sleep 1
+if [ "$(cat bg.out 2>/dev/null)" != "$(grep -c 7 nums)" ]; then
+    echo "FAIL bg-last-line: wrong or missing output"
+    failed=$((failed + 1))
+fi
+
+# head leaves a last line without its newline as it is
+printf 'a\nb\nc' > nonl
+check head-no-newline "head nonl" "$(printf 'a\nb\nc')"
+check head-no-newline-pipe "cat nonl | head" "$(printf 'a\nb\nc')"
+check head-no-newline-fused "grep -v x nonl | head -2" "a
+b
+"
+
+# tr forms the builtin doesn't know go to the real tr
+printf 'abcd\n' > letters
+check tr-repeat "tr abc [x*] < letters" "xxxd
+"
+check tr-repeat-n "tr abc [x*2]y < letters" "xxyd
+"
+check tr-equiv "tr [=a=] z < letters" "zbcd
+"
+
+# every and at want a pipeline after --, nothing is scheduled without
+check every-empty "every 5s --
+every 5s -- 
+every" ""
+check at-empty "at +1s --
+at" ""
+
+# prio takes a nice value of -20 to 19 and nothing else
+check prio-nice "prio -n 5 nice
+prio -n 5x nice
+prio -n 20 nice
+prio -n abc nice" "5
+"
+
+echo "run: $((total - failed))/$total passed"
+[ $failed -eq 0 ]